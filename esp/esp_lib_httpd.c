@@ -6,9 +6,11 @@
 #include <sys/unistd.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <assert.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_system.h"
 #include "nvs_flash.h"
@@ -16,6 +18,7 @@
 #include "esp_http_server.h"
 #include "esp_vfs.h"
 #include "mdns.h"
+#include "esp32/rom/md5_hash.h"
 #include "esp_lua_lib.h"
 
 static const char *TAG = "esp_lib_httpd";
@@ -25,35 +28,144 @@ static const char *TAG = "esp_lib_httpd";
 #define MAX_FILE_SIZE   (200*1024) // 200 KB
 #define MAX_FILE_SIZE_STR "200KB"
 
+/* stdio buffer for uploads, a multiple of the 256 B SPIFFS page and
+ * equal to the 4 KB block used by tools/lua_flash.sh */
+#ifndef UPLOAD_BUFSIZE
+#define UPLOAD_BUFSIZE (4096)
+#endif
+
 #define HTTPD_EVENT_QUEUE_NUM 100
 
 static httpd_handle_t server = NULL;
 static QueueHandle_t httpd_event_queue = NULL;
+static esp_lua_queue_t httpd_event_conf = {0};
+
+/* Bodies at least this large are streamed to Lua in chunks, each chunk
+ * event waits this long for room in the queue before the request fails */
+#define HTTPD_STREAM_WAIT_MS (10000)
+
+/* A request routed to a Lua handler with httpd.on(). The server task and
+ * the Lua task each hold a reference, whichever finishes last frees it, so
+ * a handler that gave up waiting never races a late Lua response. */
+typedef struct {
+    int refs;
+    SemaphoreHandle_t done;
+    char *route;
+    const char *method;
+    int status;
+    char *body;
+    size_t body_len;
+    char *headers;
+    int header_num;
+} httpd_pending_t;
+
+static SemaphoreHandle_t httpd_pending_lock = NULL;
+
+static void httpd_pending_put(httpd_pending_t *p)
+{
+    xSemaphoreTake(httpd_pending_lock, portMAX_DELAY);
+    int refs = --p->refs;
+    xSemaphoreGive(httpd_pending_lock);
+    if (refs == 0) {
+        vSemaphoreDelete(p->done);
+        free(p->route);
+        free(p->body);
+        free(p->headers);
+        free(p);
+    }
+}
 
 typedef struct {
-    char *event;
+    const char *event;
     char *uri;
     char *data;
+    int data_len;
+    int offset;
+    int total;
+    int fd;
+    bool lossless;
+    httpd_pending_t *pending;
 } httpd_event_t;
 
-static int httpd_event_send(char *event, char *uri, char *data)
+static void httpd_event_free(httpd_event_t *e)
 {
-    httpd_event_t e;
-    e.event = calloc(sizeof(char), strlen(event) + 1);
-    e.uri = calloc(sizeof(char), strlen(uri) + 1);
-    e.data = calloc(sizeof(char), strlen(data) + 1);
-    strcpy(e.event, event);
-    strcpy(e.uri, uri);
-    strcpy(e.data, data);
-    if (xQueueSend(httpd_event_queue, (void *)&e, 0) != pdTRUE) {
-        free(e.event);
-        free(e.uri);
-        free(e.data);
-        return -1;
+    free(e->uri);
+    free(e->data);
+    if (e->pending) {
+        httpd_pending_put(e->pending);
+    }
+}
+
+/* Queue e, taking ownership of its buffers, lossless events bypass the drop
+ * policy and are never evicted by drop_oldest, a stream chunk lost mid-body
+ * would leave a hole that HTTPD_POST_END_EVENT then claims is complete.
+ * Lossless events wait up to ticks for room in the queue */
+static int httpd_event_post_wait(httpd_event_t *e, bool lossless, TickType_t ticks)
+{
+    e->lossless = lossless;
+    if (!lossless) {
+        ticks = (httpd_event_conf.policy == ESP_LUA_DROP_BLOCK) ? ESP_LUA_TIMEOUT_TICKS(httpd_event_conf.block_ms) : 0;
+    }
+    if (xQueueSend(httpd_event_queue, (void *)e, ticks) != pdTRUE) {
+        httpd_event_t old;
+        bool oldest = (!lossless && httpd_event_conf.policy == ESP_LUA_DROP_OLDEST);
+        if (oldest && xQueueReceive(httpd_event_queue, (void *)&old, 0) == pdTRUE) {
+            if (old.lossless) {
+                /* Only the httpd task posts, so the slot just freed is still there */
+                xQueueSendToFront(httpd_event_queue, (void *)&old, 0);
+                oldest = false;
+            } else {
+                httpd_event_free(&old);
+            }
+        }
+        httpd_event_conf.dropped++;
+        if (!oldest || xQueueSend(httpd_event_queue, (void *)e, 0) != pdTRUE) {
+            httpd_event_free(e);
+            return -1;
+        }
+    }
+    httpd_event_conf.enqueued++;
+    UBaseType_t waiting = uxQueueMessagesWaiting(httpd_event_queue);
+    if (waiting > httpd_event_conf.high_water) {
+        httpd_event_conf.high_water = waiting;
     }
+    esp_lua_event_notify();
     return 0;
 }
 
+static int httpd_event_post(httpd_event_t *e, bool lossless)
+{
+    return httpd_event_post_wait(e, lossless, HTTPD_STREAM_WAIT_MS / portTICK_PERIOD_MS);
+}
+
+/* Queue a copy of data, stream chunks are lossless since losing one would corrupt the body */
+static int httpd_event_send_chunk(const char *event, const char *uri, const char *data, int len, int offset, int total, bool stream)
+{
+    httpd_event_t e = {
+        .event = event,
+        .data_len = len,
+        .offset = offset,
+        .total = total,
+    };
+    uri = uri ? uri : "";
+    e.uri = strdup(uri);
+    e.data = malloc(len + 1);
+    if (e.uri == NULL || e.data == NULL) {
+        httpd_event_free(&e);
+        httpd_event_conf.dropped++;
+        return -1;
+    }
+    memcpy(e.data, data, len);
+    e.data[len] = '\0';
+
+    return httpd_event_post(&e, stream);
+}
+
+static int httpd_event_send(const char *event, const char *uri, const char *data, int len)
+{
+    return httpd_event_send_chunk(event, uri, data, len, 0, 0, false);
+}
+
 #define REST_CHECK(a, str, goto_tag, ...)                                              \
     do                                                                                 \
     {                                                                                  \
@@ -67,39 +179,396 @@ static int httpd_event_send(char *event, char *uri, char *data)
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + 128)
 #define SCRATCH_BUFSIZE (10240)
 
+/* Each request borrows its own scratch buffer from a small pool instead of
+ * sharing one, so handlers no longer depend on being serialized. IDF 4.0
+ * runs handlers one at a time on the httpd task, so without PSRAM a single
+ * buffer is all that is ever in use and internal RAM is not spent on more */
+#if CONFIG_SPIRAM
+#define SCRATCH_NUM 4
+#else
+#define SCRATCH_NUM 1
+#endif
+#define SCRATCH_WAIT_MS (5000)
+
 typedef struct rest_server_context {
     char base_path[ESP_VFS_PATH_MAX + 1];
-    char scratch[SCRATCH_BUFSIZE];
+    QueueHandle_t scratch_pool;
+    char *scratch[SCRATCH_NUM];
 } rest_server_context_t;
 
+static void rest_context_free(void *ctx)
+{
+    rest_server_context_t *rest_context = (rest_server_context_t *)ctx;
+    if (rest_context->scratch_pool) {
+        vQueueDelete(rest_context->scratch_pool);
+    }
+    for (int x = 0; x < SCRATCH_NUM; x++) {
+        free(rest_context->scratch[x]);
+    }
+    free(rest_context);
+}
+
+static rest_server_context_t *rest_context_create(const char *base_path)
+{
+    rest_server_context_t *rest_context = calloc(1, sizeof(rest_server_context_t));
+    if (rest_context == NULL) {
+        return NULL;
+    }
+    strlcpy(rest_context->base_path, base_path, sizeof(rest_context->base_path));
+    rest_context->scratch_pool = xQueueCreate(SCRATCH_NUM, sizeof(char *));
+    for (int x = 0; rest_context->scratch_pool && x < SCRATCH_NUM; x++) {
+        rest_context->scratch[x] = malloc(SCRATCH_BUFSIZE);
+        if (rest_context->scratch[x] == NULL) {
+            rest_context_free(rest_context);
+            return NULL;
+        }
+        xQueueSend(rest_context->scratch_pool, (void *)&rest_context->scratch[x], 0);
+    }
+    if (rest_context->scratch_pool == NULL) {
+        rest_context_free(rest_context);
+        return NULL;
+    }
+    return rest_context;
+}
+
+static char *rest_scratch_get(httpd_req_t *req)
+{
+    char *buf = NULL;
+    rest_server_context_t *rest_context = (rest_server_context_t *)req->user_ctx;
+    if (xQueueReceive(rest_context->scratch_pool, (void *)&buf, SCRATCH_WAIT_MS / portTICK_PERIOD_MS) != pdTRUE) {
+        ESP_LOGE(TAG, "No scratch buffer for %s", req->uri);
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_sendstr(req, "Server busy");
+        return NULL;
+    }
+    return buf;
+}
+
+static void rest_scratch_put(httpd_req_t *req, char *buf)
+{
+    rest_server_context_t *rest_context = (rest_server_context_t *)req->user_ctx;
+    xQueueSend(rest_context->scratch_pool, (void *)&buf, 0);
+}
+
 #define CHECK_FILE_EXTENSION(filename, ext) (strcasecmp(&filename[strlen(filename) - strlen(ext)], ext) == 0)
 
+/* File extension to MIME type, kept sorted by extension for bsearch() */
+#define HTTPD_MIME_TABLE(X)                         \
+    X("bin",   "application/octet-stream")          \
+    X("css",   "text/css")                          \
+    X("csv",   "text/csv")                          \
+    X("gif",   "image/gif")                         \
+    X("gz",    "application/gzip")                  \
+    X("htm",   "text/html")                         \
+    X("html",  "text/html")                         \
+    X("ico",   "image/x-icon")                      \
+    X("jpeg",  "image/jpeg")                        \
+    X("jpg",   "image/jpeg")                        \
+    X("js",    "application/javascript")            \
+    X("json",  "application/json")                  \
+    X("lua",   "text/plain")                        \
+    X("map",   "application/json")                  \
+    X("mjs",   "application/javascript")            \
+    X("mp3",   "audio/mpeg")                        \
+    X("pdf",   "application/pdf")                   \
+    X("png",   "image/png")                         \
+    X("svg",   "image/svg+xml")                     \
+    X("ttf",   "font/ttf")                          \
+    X("txt",   "text/plain")                        \
+    X("wasm",  "application/wasm")                  \
+    X("webp",  "image/webp")                        \
+    X("woff",  "font/woff")                         \
+    X("woff2", "font/woff2")                        \
+    X("xml",   "text/xml")                          \
+    X("zip",   "application/zip")
+
+typedef struct {
+    const char *ext;
+    const char *type;
+} httpd_mime_t;
+
+#define HTTPD_MIME_ENTRY(ext, type) {ext, type},
+static const httpd_mime_t httpd_mime_table[] = {
+    HTTPD_MIME_TABLE(HTTPD_MIME_ENTRY)
+};
+#undef HTTPD_MIME_ENTRY
+
+static int httpd_mime_cmp(const void *key, const void *entry)
+{
+    return strcasecmp((const char *)key, ((const httpd_mime_t *)entry)->ext);
+}
+
+/* An entry added out of order would silently fall back to text/plain */
+static void httpd_mime_table_check()
+{
+    for (int x = 1; x < sizeof(httpd_mime_table) / sizeof(httpd_mime_table[0]); x++) {
+        if (strcasecmp(httpd_mime_table[x - 1].ext, httpd_mime_table[x].ext) >= 0) {
+            ESP_LOGE(TAG, "HTTPD_MIME_TABLE not sorted at .%s", httpd_mime_table[x].ext);
+            assert(false);
+        }
+    }
+}
+
 /* Set HTTP response content type according to file extension */
 static esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filepath)
 {
     const char *type = "text/plain";
-    if (CHECK_FILE_EXTENSION(filepath, ".html")) {
-        type = "text/html";
-    } else if (CHECK_FILE_EXTENSION(filepath, ".js")) {
-        type = "application/javascript";
-    } else if (CHECK_FILE_EXTENSION(filepath, ".css")) {
-        type = "text/css";
-    } else if (CHECK_FILE_EXTENSION(filepath, ".png")) {
-        type = "image/png";
-    } else if (CHECK_FILE_EXTENSION(filepath, ".ico")) {
-        type = "image/x-icon";
-    } else if (CHECK_FILE_EXTENSION(filepath, ".svg")) {
-        type = "text/xml";
+    const char *name = strrchr(filepath, '/');
+    const char *ext = strrchr(name ? name : filepath, '.');
+    if (ext) {
+        const httpd_mime_t *mime = bsearch(ext + 1, httpd_mime_table,
+                                           sizeof(httpd_mime_table) / sizeof(httpd_mime_table[0]),
+                                           sizeof(httpd_mime_t), httpd_mime_cmp);
+        if (mime) {
+            type = mime->type;
+        }
     }
     return httpd_resp_set_type(req, type);
 }
 
+/* Hot static files are kept in RAM with their ETag, so repeated page loads
+ * skip SPIFFS and revalidating browsers get a 304 without a body. Entries are
+ * reference counted, an entry evicted while being sent is freed by its last user. */
+#if CONFIG_SPIRAM
+#define HTTPD_CACHE_NUM 32
+#define HTTPD_CACHE_SIZE (512*1024)
+#define HTTPD_CACHE_FILE_MAX (64*1024)
+#else
+#define HTTPD_CACHE_NUM 8
+#define HTTPD_CACHE_SIZE (32*1024)
+#define HTTPD_CACHE_FILE_MAX (8*1024)
+#endif
+
+/* Files can change through /upload, so let browsers keep them but always revalidate */
+#ifndef HTTPD_CACHE_CONTROL
+#define HTTPD_CACHE_CONTROL "no-cache"
+#endif
+
+typedef struct {
+    char path[FILE_PATH_MAX];
+    char *data;
+    size_t size;
+    char etag[35];
+    char last_modified[32];
+    time_t mtime;
+    uint32_t used;
+    int ref;
+} httpd_cache_entry_t;
+
+static httpd_cache_entry_t *httpd_cache[HTTPD_CACHE_NUM] = {0};
+static size_t httpd_cache_bytes = 0;
+static uint32_t httpd_cache_tick = 0;
+static uint32_t httpd_cache_gen = 0;
+static SemaphoreHandle_t httpd_cache_lock = NULL;
+
+static void httpd_cache_put(httpd_cache_entry_t *entry)
+{
+    xSemaphoreTake(httpd_cache_lock, portMAX_DELAY);
+    int ref = --entry->ref;
+    xSemaphoreGive(httpd_cache_lock);
+    if (ref == 0) {
+        free(entry->data);
+        free(entry);
+    }
+}
+
+/* Must be called with httpd_cache_lock held, returns the entry to release once unlocked */
+static httpd_cache_entry_t *httpd_cache_remove(int x)
+{
+    httpd_cache_entry_t *entry = httpd_cache[x];
+    httpd_cache[x] = NULL;
+    httpd_cache_bytes -= entry->size;
+    if (--entry->ref == 0) {
+        return entry;
+    }
+    return NULL;
+}
+
+static void httpd_cache_invalidate(const char *path);
+
+/* Files may also be rewritten from Lua behind the server's back, so a hit
+ * is only used while size and mtime still match what was cached */
+static httpd_cache_entry_t *httpd_cache_get(const char *path)
+{
+    httpd_cache_entry_t *entry = NULL;
+    xSemaphoreTake(httpd_cache_lock, portMAX_DELAY);
+    for (int x = 0; x < HTTPD_CACHE_NUM; x++) {
+        if (httpd_cache[x] && strcmp(httpd_cache[x]->path, path) == 0) {
+            entry = httpd_cache[x];
+            entry->used = ++httpd_cache_tick;
+            entry->ref++;
+            break;
+        }
+    }
+    xSemaphoreGive(httpd_cache_lock);
+
+    struct stat st;
+    if (entry && (stat(path, &st) != 0 || st.st_size != entry->size || st.st_mtime != entry->mtime)) {
+        httpd_cache_put(entry);
+        httpd_cache_invalidate(path);
+        entry = NULL;
+    }
+    return entry;
+}
+
+/* Drop path from the cache, or everything when path is NULL */
+static void httpd_cache_invalidate(const char *path)
+{
+    if (httpd_cache_lock == NULL) {
+        return;
+    }
+    for (int x = 0; x < HTTPD_CACHE_NUM; x++) {
+        httpd_cache_entry_t *entry = NULL;
+        xSemaphoreTake(httpd_cache_lock, portMAX_DELAY);
+        httpd_cache_gen++;
+        if (httpd_cache[x] && (path == NULL || strcmp(httpd_cache[x]->path, path) == 0)) {
+            entry = httpd_cache_remove(x);
+        }
+        xSemaphoreGive(httpd_cache_lock);
+        if (entry) {
+            free(entry->data);
+            free(entry);
+        }
+    }
+}
+
+/* Read a small file into a new entry and insert it, NULL when it should be served from storage */
+static httpd_cache_entry_t *httpd_cache_load(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || st.st_size > HTTPD_CACHE_FILE_MAX) {
+        return NULL;
+    }
+
+    xSemaphoreTake(httpd_cache_lock, portMAX_DELAY);
+    uint32_t gen = httpd_cache_gen;
+    xSemaphoreGive(httpd_cache_lock);
+
+    httpd_cache_entry_t *entry = calloc(1, sizeof(httpd_cache_entry_t));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->data = malloc(st.st_size ? st.st_size : 1);
+    int fd = open(path, O_RDONLY, 0);
+    if (entry->data == NULL || fd == -1) {
+        goto err;
+    }
+    while (entry->size < st.st_size) {
+        ssize_t read_bytes = read(fd, entry->data + entry->size, st.st_size - entry->size);
+        if (read_bytes <= 0) {
+            break;
+        }
+        entry->size += read_bytes;
+    }
+    close(fd);
+    fd = -1;
+    if (entry->size != st.st_size) {
+        goto err;
+    }
+
+    unsigned char digest[16];
+    struct MD5Context md5_ctx;
+    MD5Init(&md5_ctx);
+    MD5Update(&md5_ctx, (const unsigned char *)entry->data, entry->size);
+    MD5Final(digest, &md5_ctx);
+    entry->etag[0] = '"';
+    for (int x = 0; x < 16; x++) {
+        sprintf(&entry->etag[1 + x * 2], "%02x", (unsigned int)digest[x]);
+    }
+    strcat(entry->etag, "\"");
+    if (st.st_mtime > 0) {
+        struct tm tm;
+        gmtime_r(&st.st_mtime, &tm);
+        strftime(entry->last_modified, sizeof(entry->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    }
+    strlcpy(entry->path, path, sizeof(entry->path));
+    entry->mtime = st.st_mtime;
+    entry->ref = 1;
+
+    /* Evict least recently used entries until the new one fits */
+    xSemaphoreTake(httpd_cache_lock, portMAX_DELAY);
+    if (gen == httpd_cache_gen) {
+        while (1) {
+            int slot = -1, lru = -1;
+            for (int x = 0; x < HTTPD_CACHE_NUM; x++) {
+                if (httpd_cache[x] == NULL) {
+                    slot = x;
+                } else if (lru < 0 || httpd_cache[x]->used < httpd_cache[lru]->used) {
+                    lru = x;
+                }
+            }
+            if (slot >= 0 && httpd_cache_bytes + entry->size <= HTTPD_CACHE_SIZE) {
+                entry->used = ++httpd_cache_tick;
+                entry->ref++;
+                httpd_cache[slot] = entry;
+                httpd_cache_bytes += entry->size;
+                break;
+            }
+            if (lru < 0) {
+                break;
+            }
+            httpd_cache_entry_t *old = httpd_cache_remove(lru);
+            if (old) {
+                /* Unused, nobody else can reach it any more */
+                free(old->data);
+                free(old);
+            }
+        }
+    }
+    xSemaphoreGive(httpd_cache_lock);
+    return entry;
+
+err:
+    if (fd != -1) {
+        close(fd);
+    }
+    free(entry->data);
+    free(entry);
+    return NULL;
+}
+
+static esp_err_t httpd_cache_send(httpd_req_t *req, httpd_cache_entry_t *entry)
+{
+    httpd_resp_set_hdr(req, "ETag", entry->etag);
+    httpd_resp_set_hdr(req, "Cache-Control", HTTPD_CACHE_CONTROL);
+    if (entry->last_modified[0]) {
+        httpd_resp_set_hdr(req, "Last-Modified", entry->last_modified);
+    }
+
+    size_t len = httpd_req_get_hdr_value_len(req, "If-None-Match");
+    if (len > 0) {
+        char *match = malloc(len + 1);
+        bool hit = match && httpd_req_get_hdr_value_str(req, "If-None-Match", match, len + 1) == ESP_OK
+                   && (strstr(match, entry->etag) != NULL || strcmp(match, "*") == 0);
+        free(match);
+        if (hit) {
+            httpd_resp_set_status(req, "304 Not Modified");
+            return httpd_resp_send(req, NULL, 0);
+        }
+    }
+
+    return httpd_resp_send(req, entry->data, entry->size);
+}
+
+static bool httpd_accepts_gzip(httpd_req_t *req)
+{
+    bool gzip = false;
+    size_t len = httpd_req_get_hdr_value_len(req, "Accept-Encoding");
+    if (len > 0) {
+        char *value = malloc(len + 1);
+        if (value && httpd_req_get_hdr_value_str(req, "Accept-Encoding", value, len + 1) == ESP_OK) {
+            gzip = (strstr(value, "gzip") != NULL);
+        }
+        free(value);
+    }
+    return gzip;
+}
+
 /* Send HTTP response with the contents of the requested file */
-static esp_err_t rest_common_get_handler(httpd_req_t *req)
+static esp_err_t rest_common_get(httpd_req_t *req, char *buf)
 {
     int total_len = req->content_len;
     int cur_len = 0;
-    char *buf = ((rest_server_context_t *)(req->user_ctx))->scratch;
     int received = 0;
     if (total_len >= SCRATCH_BUFSIZE) {
         /* Respond with 500 Internal Server Error */
@@ -107,7 +576,7 @@ static esp_err_t rest_common_get_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
     while (cur_len < total_len) {
-        received = httpd_req_recv(req, buf + cur_len, total_len);
+        received = httpd_req_recv(req, buf + cur_len, total_len - cur_len);
         if (received <= 0) {
             /* Respond with 500 Internal Server Error */
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to post control value");
@@ -115,8 +584,7 @@ static esp_err_t rest_common_get_handler(httpd_req_t *req)
         }
         cur_len += received;
     }
-    buf[total_len] = '\0';
-    httpd_event_send("HTTPD_GET_EVENT", req->uri, buf);
+    httpd_event_send("HTTPD_GET_EVENT", req->uri, buf, total_len);
 
     char filepath[FILE_PATH_MAX];
     rest_server_context_t *rest_context = (rest_server_context_t *)req->user_ctx;
@@ -126,7 +594,33 @@ static esp_err_t rest_common_get_handler(httpd_req_t *req)
     } else {
         strlcat(filepath, req->uri, sizeof(filepath));
     }
-    int fd = open(filepath, O_RDONLY, 0);
+
+    /* Prefer a precompressed sibling, and serve it anyway when only the .gz was flashed */
+    char gzpath[FILE_PATH_MAX];
+    const char *path = filepath;
+    struct stat file_stat;
+    if (!CHECK_FILE_EXTENSION(filepath, ".gz")
+        && snprintf(gzpath, sizeof(gzpath), "%s.gz", filepath) < sizeof(gzpath)
+        && stat(gzpath, &file_stat) == 0) {
+        httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+        if (httpd_accepts_gzip(req) || stat(filepath, &file_stat) != 0) {
+            httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+            path = gzpath;
+        }
+    }
+
+    httpd_cache_entry_t *entry = httpd_cache_get(path);
+    if (entry == NULL) {
+        entry = httpd_cache_load(path);
+    }
+    if (entry != NULL) {
+        set_content_type_from_file(req, filepath);
+        esp_err_t err = httpd_cache_send(req, entry);
+        httpd_cache_put(entry);
+        return err;
+    }
+
+    int fd = open(path, O_RDONLY, 0);
     if (fd == -1) {
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
@@ -135,13 +629,13 @@ static esp_err_t rest_common_get_handler(httpd_req_t *req)
 
     set_content_type_from_file(req, filepath);
 
-    char *chunk = rest_context->scratch;
+    char *chunk = buf;
     ssize_t read_bytes;
     do {
         /* Read file in chunks into the scratch buffer */
         read_bytes = read(fd, chunk, SCRATCH_BUFSIZE);
         if (read_bytes == -1) {
-            ESP_LOGE(TAG, "Failed to read file : %s", filepath);
+            ESP_LOGE(TAG, "Failed to read file : %s", path);
         } else if (read_bytes > 0) {
             /* Send the buffer contents as HTTP response chunk */
             if (httpd_resp_send_chunk(req, chunk, read_bytes) != ESP_OK) {
@@ -163,19 +657,51 @@ static esp_err_t rest_common_get_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
-static esp_err_t rest_common_post_handler(httpd_req_t *req)
+/* Deliver a body too large for one event as HTTPD_POST_DATA_EVENT chunks
+ * closed by HTTPD_POST_END_EVENT, or HTTPD_POST_ABORT_EVENT on failure */
+static esp_err_t rest_common_post_stream(httpd_req_t *req, char *buf)
+{
+    int total_len = req->content_len;
+    int cur_len = 0;
+    while (cur_len < total_len) {
+        int received = httpd_req_recv(req, buf, MIN(total_len - cur_len, SCRATCH_BUFSIZE));
+        if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+            /* Retry if timeout occurred */
+            continue;
+        }
+        if (received <= 0) {
+            httpd_event_send_chunk("HTTPD_POST_ABORT_EVENT", req->uri, "", 0, cur_len, total_len, true);
+            /* Respond with 500 Internal Server Error */
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive post data");
+            return ESP_FAIL;
+        }
+        if (httpd_event_send_chunk("HTTPD_POST_DATA_EVENT", req->uri, buf, received, cur_len, total_len, true) != 0) {
+            ESP_LOGE(TAG, "Lua did not consume post data for %s", req->uri);
+            httpd_event_send_chunk("HTTPD_POST_ABORT_EVENT", req->uri, "", 0, cur_len, total_len, true);
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Post data not consumed");
+            return ESP_FAIL;
+        }
+        cur_len += received;
+    }
+    httpd_event_send_chunk("HTTPD_POST_END_EVENT", req->uri, "", 0, cur_len, total_len, true);
+
+    httpd_resp_sendstr(req, "Post control value successfully");
+    return ESP_OK;
+}
+
+static esp_err_t rest_common_post(httpd_req_t *req, char *buf)
 {
     int total_len = req->content_len;
     int cur_len = 0;
-    char *buf = ((rest_server_context_t *)(req->user_ctx))->scratch;
     int received = 0;
     if (total_len >= SCRATCH_BUFSIZE) {
-        /* Respond with 500 Internal Server Error */
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "content too long");
-        return ESP_FAIL;
+        return rest_common_post_stream(req, buf);
     }
     while (cur_len < total_len) {
-        received = httpd_req_recv(req, buf + cur_len, total_len);
+        received = httpd_req_recv(req, buf + cur_len, total_len - cur_len);
+        if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+            continue;
+        }
         if (received <= 0) {
             /* Respond with 500 Internal Server Error */
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to post control value");
@@ -183,8 +709,7 @@ static esp_err_t rest_common_post_handler(httpd_req_t *req)
         }
         cur_len += received;
     }
-    buf[total_len] = '\0';
-    httpd_event_send("HTTPD_POST_EVENT", req->uri, buf);
+    httpd_event_send("HTTPD_POST_EVENT", req->uri, buf, total_len);
 
     httpd_resp_sendstr(req, "Post control value successfully");
     return ESP_OK;
@@ -219,8 +744,34 @@ static const char* get_path_from_uri(char *dest, const char *base_path, const ch
     return dest + base_pathlen;
 }
 
+static void httpd_remove_gz_sibling(const char *filepath)
+{
+    char gzpath[FILE_PATH_MAX];
+    if (!CHECK_FILE_EXTENSION(filepath, ".gz")
+        && snprintf(gzpath, sizeof(gzpath), "%s.gz", filepath) < sizeof(gzpath)) {
+        unlink(gzpath);
+        httpd_cache_invalidate(gzpath);
+    }
+}
+
+/* Move a finished temporary file over path. SPIFFS refuses to rename onto
+ * an existing name, so the old file is dropped only then; if the rename
+ * still fails the temporary file is kept so the data is not lost too */
+static int httpd_file_replace(const char *tmppath, const char *path)
+{
+    if (rename(tmppath, path) == 0) {
+        return 0;
+    }
+    unlink(path);
+    if (rename(tmppath, path) == 0) {
+        return 0;
+    }
+    ESP_LOGE(TAG, "Failed to rename : %s", tmppath);
+    return -1;
+}
+
 /* Handler to upload a file onto the server */
-static esp_err_t upload_post_handler(httpd_req_t *req)
+static esp_err_t upload_post(httpd_req_t *req, char *buf)
 {
     char filepath[FILE_PATH_MAX];
     FILE *fd = NULL;
@@ -230,7 +781,7 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
     /* Note sizeof() counts NULL termination hence the -1 */
     const char *filename = get_path_from_uri(filepath, ((rest_server_context_t *)req->user_ctx)->base_path,
                                              req->uri + sizeof("/upload") - 1, sizeof(filepath));
-    httpd_event_send("HTTPD_UPLOAD_EVENT", filename, "");
+    httpd_event_send("HTTPD_UPLOAD_EVENT", filename, "", 0);
     if (!filename) {
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
@@ -263,19 +814,40 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
-    fd = fopen(filepath, "w");
+    /* Optional hex MD5 of the body, checked before the file replaces the old one */
+    char md5_expect[33] = "";
+    size_t md5_len = httpd_req_get_hdr_value_len(req, "X-Content-MD5");
+    if (md5_len > 0) {
+        if (md5_len != 32
+            || httpd_req_get_hdr_value_str(req, "X-Content-MD5", md5_expect, sizeof(md5_expect)) != ESP_OK
+            || strspn(md5_expect, "0123456789abcdefABCDEF") != 32) {
+            ESP_LOGE(TAG, "Invalid X-Content-MD5 : %s", filename);
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "X-Content-MD5 must be 32 hex digits");
+            return ESP_FAIL;
+        }
+    }
+
+    /* Receive into a temporary file and only rename it over the target once
+     * complete, so a broken upload never leaves a half-written script */
+    char tmppath[FILE_PATH_MAX];
+    if (snprintf(tmppath, sizeof(tmppath), "%s~", filepath) >= sizeof(tmppath)) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
+        return ESP_FAIL;
+    }
+    fd = fopen(tmppath, "w");
     if (!fd) {
-        ESP_LOGE(TAG, "Failed to create file : %s", filepath);
+        ESP_LOGE(TAG, "Failed to create file : %s", tmppath);
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create file");
         return ESP_FAIL;
     }
+    setvbuf(fd, NULL, _IOFBF, UPLOAD_BUFSIZE);
 
     ESP_LOGI(TAG, "Receiving file : %s...", filename);
 
-    /* Retrieve the pointer to scratch buffer for temporary storage */
-    char *buf = ((rest_server_context_t *)req->user_ctx)->scratch;
     int received;
+    struct MD5Context md5_ctx;
+    MD5Init(&md5_ctx);
 
     /* Content length of the request gives
      * the size of the file being uploaded */
@@ -283,7 +855,7 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
 
     while (remaining > 0) {
 
-        ESP_LOGI(TAG, "Remaining size : %d", remaining);
+        ESP_LOGD(TAG, "Remaining size : %d", remaining);
         /* Receive the file part by part into a buffer */
         if ((received = httpd_req_recv(req, buf, MIN(remaining, SCRATCH_BUFSIZE))) <= 0) {
             if (received == HTTPD_SOCK_ERR_TIMEOUT) {
@@ -294,7 +866,7 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
             /* In case of unrecoverable error,
              * close and delete the unfinished file*/
             fclose(fd);
-            unlink(filepath);
+            unlink(tmppath);
 
             ESP_LOGE(TAG, "File reception failed!");
             /* Respond with 500 Internal Server Error */
@@ -307,21 +879,51 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
             /* Couldn't write everything to file!
              * Storage may be full? */
             fclose(fd);
-            unlink(filepath);
+            unlink(tmppath);
 
             ESP_LOGE(TAG, "File write failed!");
             /* Respond with 500 Internal Server Error */
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage");
             return ESP_FAIL;
         }
+        MD5Update(&md5_ctx, (const unsigned char *)buf, received);
 
         /* Keep track of remaining size of
          * the file left to be uploaded */
         remaining -= received;
     }
 
-    /* Close file upon upload completion */
-    fclose(fd);
+    /* Close file upon upload completion, flushing the last buffered page */
+    if (fclose(fd) != 0) {
+        unlink(tmppath);
+        ESP_LOGE(TAG, "File write failed!");
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage");
+        return ESP_FAIL;
+    }
+
+    if (md5_expect[0]) {
+        unsigned char digest[16];
+        char md5sum[33];
+        MD5Final(digest, &md5_ctx);
+        for (int x = 0; x < 16; x++) {
+            sprintf(&md5sum[x * 2], "%02x", (unsigned int)digest[x]);
+        }
+        if (strcasecmp(md5sum, md5_expect) != 0) {
+            unlink(tmppath);
+            ESP_LOGE(TAG, "MD5 mismatch : %s", filename);
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "MD5 mismatch");
+            return ESP_FAIL;
+        }
+    }
+
+    if (httpd_file_replace(tmppath, filepath) != 0) {
+        httpd_cache_invalidate(filepath);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to rename, upload kept as name~");
+        return ESP_FAIL;
+    }
+    httpd_cache_invalidate(filepath);
+    /* A stale precompressed copy would otherwise keep being served instead */
+    httpd_remove_gz_sibling(filepath);
     ESP_LOGI(TAG, "File reception complete");
 
     // /* Redirect onto root to see the updated file list */
@@ -331,6 +933,39 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+static esp_err_t rest_common_get_handler(httpd_req_t *req)
+{
+    char *buf = rest_scratch_get(req);
+    if (buf == NULL) {
+        return ESP_FAIL;
+    }
+    esp_err_t ret = rest_common_get(req, buf);
+    rest_scratch_put(req, buf);
+    return ret;
+}
+
+static esp_err_t rest_common_post_handler(httpd_req_t *req)
+{
+    char *buf = rest_scratch_get(req);
+    if (buf == NULL) {
+        return ESP_FAIL;
+    }
+    esp_err_t ret = rest_common_post(req, buf);
+    rest_scratch_put(req, buf);
+    return ret;
+}
+
+static esp_err_t upload_post_handler(httpd_req_t *req)
+{
+    char *buf = rest_scratch_get(req);
+    if (buf == NULL) {
+        return ESP_FAIL;
+    }
+    esp_err_t ret = upload_post(req, buf);
+    rest_scratch_put(req, buf);
+    return ret;
+}
+
 /* Handler to delete a file from the server */
 static esp_err_t delete_post_handler(httpd_req_t *req)
 {
@@ -341,7 +976,7 @@ static esp_err_t delete_post_handler(httpd_req_t *req)
     /* Note sizeof() counts NULL termination hence the -1 */
     const char *filename = get_path_from_uri(filepath, ((rest_server_context_t *)req->user_ctx)->base_path,
                                              req->uri  + sizeof("/delete") - 1, sizeof(filepath));
-    httpd_event_send("HTTPD_DELETE_EVENT", filename, "");
+    httpd_event_send("HTTPD_DELETE_EVENT", filename, "", 0);
     if (!filename) {
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
@@ -365,6 +1000,8 @@ static esp_err_t delete_post_handler(httpd_req_t *req)
     ESP_LOGI(TAG, "Deleting file : %s", filename);
     /* Delete file */
     unlink(filepath);
+    httpd_cache_invalidate(filepath);
+    httpd_remove_gz_sibling(filepath);
 
     // /* Redirect onto root to see the updated file list */
     // httpd_resp_set_status(req, "303 See Other");
@@ -373,56 +1010,1119 @@ static esp_err_t delete_post_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
-esp_err_t start_rest_server(const char *base_path)
-{
-    REST_CHECK(base_path, "wrong base path", err);
-    rest_server_context_t *rest_context = calloc(1, sizeof(rest_server_context_t));
-    REST_CHECK(rest_context, "No memory for rest context", err);
-    strlcpy(rest_context->base_path, base_path, sizeof(rest_context->base_path));
+static char *list_json_str(char *dest, const char *s);
 
-    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.uri_match_fn = httpd_uri_match_wildcard;
+/* Multi-file deploy: POST /bundle takes a ustar archive and unpacks it under
+ * the base path in a single request. Every member goes to a temporary file
+ * first and all of them are renamed into place only once the whole archive
+ * arrived, so a broken transfer leaves the previous app intact. */
+#define BUNDLE_BLOCK_SIZE 512
+#define BUNDLE_FILE_NUM 64
 
-    ESP_LOGI(TAG, "Starting HTTP Server");
-    REST_CHECK(httpd_start(&server, &config) == ESP_OK, "Start server failed", err_start);
+typedef struct {
+    int num;
+    char *path[BUNDLE_FILE_NUM];
+} bundle_files_t;
 
-    /* URI handler for uploading files to server */
-    httpd_uri_t file_upload = {
-        .uri       = "/upload/*",   // Match all URIs of type /upload/path/to/file
-        .method    = HTTP_POST,
-        .handler   = upload_post_handler,
-        .user_ctx  = rest_context    // Pass server data as context
-    };
-    httpd_register_uri_handler(server, &file_upload);
+static int bundle_recv(httpd_req_t *req, char *buf, int len)
+{
+    int cur_len = 0;
+    while (cur_len < len) {
+        int received = httpd_req_recv(req, buf + cur_len, len - cur_len);
+        if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+            continue;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        cur_len += received;
+    }
+    return 0;
+}
 
-    /* URI handler for deleting files from server */
-    httpd_uri_t file_delete = {
-        .uri       = "/delete/*",   // Match all URIs of type /delete/path/to/file
-        .method    = HTTP_GET,
-        .handler   = delete_post_handler,
-        .user_ctx  = rest_context    // Pass server data as context
-    };
-    httpd_register_uri_handler(server, &file_delete);
+static long bundle_octal(const char *field, int len)
+{
+    long value = 0;
+    for (int x = 0; x < len && field[x]; x++) {
+        if (field[x] >= '0' && field[x] <= '7') {
+            value = value * 8 + (field[x] - '0');
+        } else if (field[x] != ' ') {
+            break;
+        }
+    }
+    return value;
+}
+
+/* Checksum counts the chksum field itself as spaces */
+static bool bundle_header_valid(const unsigned char *hdr)
+{
+    long sum = 0;
+    for (int x = 0; x < BUNDLE_BLOCK_SIZE; x++) {
+        sum += (x >= 148 && x < 156) ? ' ' : hdr[x];
+    }
+    return sum == bundle_octal((const char *)hdr + 148, 8);
+}
+
+/* Build base/prefix/name, refusing absolute and ".." paths */
+static bool bundle_member_path(char *dest, size_t size, const char *base_path, const char *hdr)
+{
+    char name[101] = {0};
+    char prefix[156] = {0};
+    memcpy(name, hdr, 100);
+    if (memcmp(hdr + 257, "ustar", 5) == 0) {
+        memcpy(prefix, hdr + 345, 155);
+    }
+    const char *member = name;
+    while (member[0] == '.' && member[1] == '/') {
+        member += 2;
+    }
+    if (member[0] == '\0' || member[0] == '/' || prefix[0] == '/' || strstr(member, "..") || strstr(prefix, "..")) {
+        return false;
+    }
+    int len = prefix[0] ? snprintf(dest, size, "%s/%s/%s", base_path, prefix, member)
+                        : snprintf(dest, size, "%s/%s", base_path, member);
+    /* Room for the '~' of the temporary name */
+    return len > 0 && len + 1 < size;
+}
+
+static bool bundle_files_has(bundle_files_t *files, const char *path)
+{
+    for (int x = 0; x < files->num; x++) {
+        if (strcmp(files->path[x], path) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Drop the temporary files of an aborted bundle, or just forget the paths */
+static void bundle_files_free(bundle_files_t *files, bool unlink_tmp)
+{
+    char tmppath[FILE_PATH_MAX];
+    for (int x = 0; x < files->num; x++) {
+        if (unlink_tmp) {
+            snprintf(tmppath, sizeof(tmppath), "%s~", files->path[x]);
+            unlink(tmppath);
+        }
+        free(files->path[x]);
+    }
+    files->num = 0;
+}
 
-    httpd_uri_t common_get_uri = {
-        .uri = "/*",
-        .method = HTTP_GET,
-        .handler = rest_common_get_handler,
-        .user_ctx = rest_context
+/* Rename every temporary file into place, returns how many were committed.
+ * The paths that failed stay in files, their name~ copies are kept */
+static int bundle_files_commit(bundle_files_t *files, const char *base_path)
+{
+    char tmppath[FILE_PATH_MAX];
+    int failed = 0;
+    int num = files->num;
+    for (int x = 0; x < num; x++) {
+        snprintf(tmppath, sizeof(tmppath), "%s~", files->path[x]);
+        int ret = httpd_file_replace(tmppath, files->path[x]);
+        httpd_cache_invalidate(files->path[x]);
+        if (ret != 0) {
+            files->path[failed++] = files->path[x];
+            continue;
+        }
+        httpd_remove_gz_sibling(files->path[x]);
+        httpd_event_send("HTTPD_UPLOAD_EVENT", files->path[x] + strlen(base_path), "", 0);
+        free(files->path[x]);
+    }
+    files->num = failed;
+    return num - failed;
+}
+
+/* Stream one member of size bytes (padded to the block size) into path~ */
+static int bundle_member_write(httpd_req_t *req, char *buf, const char *path, long size)
+{
+    char tmppath[FILE_PATH_MAX];
+    snprintf(tmppath, sizeof(tmppath), "%s~", path);
+    FILE *fd = fopen(tmppath, "w");
+    if (!fd) {
+        ESP_LOGE(TAG, "Failed to create file : %s", tmppath);
+        return -1;
+    }
+    setvbuf(fd, NULL, _IOFBF, UPLOAD_BUFSIZE);
+
+    long padded = (size + BUNDLE_BLOCK_SIZE - 1) & ~(BUNDLE_BLOCK_SIZE - 1);
+    long left = size;
+    while (padded > 0) {
+        int len = MIN(padded, SCRATCH_BUFSIZE - SCRATCH_BUFSIZE % BUNDLE_BLOCK_SIZE);
+        if (bundle_recv(req, buf, len) != 0) {
+            break;
+        }
+        int write_len = MIN(left, len);
+        if (write_len > 0 && fwrite(buf, 1, write_len, fd) != write_len) {
+            break;
+        }
+        left -= write_len;
+        padded -= len;
+    }
+    if (fclose(fd) != 0 || padded > 0) {
+        unlink(tmppath);
+        return -1;
+    }
+    return 0;
+}
+
+static esp_err_t bundle_post(httpd_req_t *req, char *buf)
+{
+    const char *base_path = ((rest_server_context_t *)req->user_ctx)->base_path;
+    bundle_files_t *files = calloc(1, sizeof(bundle_files_t));
+    char path[FILE_PATH_MAX];
+    const char *err = NULL;
+    int remaining = req->content_len;
+
+    if (files == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
+        return ESP_FAIL;
+    }
+
+    while (err == NULL && remaining >= BUNDLE_BLOCK_SIZE) {
+        if (bundle_recv(req, buf, BUNDLE_BLOCK_SIZE) != 0) {
+            err = "Failed to receive bundle";
+            break;
+        }
+        remaining -= BUNDLE_BLOCK_SIZE;
+        if (buf[0] == '\0') {
+            /* End of archive marker, the rest is padding */
+            break;
+        }
+        if (!bundle_header_valid((const unsigned char *)buf)) {
+            err = "Invalid tar header";
+            break;
+        }
+        long size = bundle_octal(buf + 124, 12);
+        long padded = (size + BUNDLE_BLOCK_SIZE - 1) & ~(BUNDLE_BLOCK_SIZE - 1);
+        char type = buf[156];
+        if (padded > remaining) {
+            err = "Truncated bundle";
+            break;
+        }
+        if (type != '0' && type != '\0') {
+            /* SPIFFS has no directories, links and the like are skipped */
+            while (padded > 0) {
+                int len = MIN(padded, SCRATCH_BUFSIZE - SCRATCH_BUFSIZE % BUNDLE_BLOCK_SIZE);
+                if (bundle_recv(req, buf, len) != 0) {
+                    err = "Failed to receive bundle";
+                    break;
+                }
+                padded -= len;
+                remaining -= len;
+            }
+            continue;
+        }
+        if (!bundle_member_path(path, sizeof(path), base_path, buf)) {
+            err = "Invalid file name in bundle";
+            break;
+        }
+        if (bundle_files_has(files, path)) {
+            /* A second copy would overwrite the first name~ and commit twice */
+            err = "Duplicate file in bundle";
+            break;
+        }
+        if (files->num >= BUNDLE_FILE_NUM || (files->path[files->num] = strdup(path)) == NULL) {
+            err = "Too many files in bundle";
+            break;
+        }
+        ESP_LOGD(TAG, "Unpacking : %s (%ld bytes)", path, size);
+        if (bundle_member_write(req, buf, path, size) != 0) {
+            free(files->path[files->num]);
+            err = "Failed to write file to storage";
+            break;
+        }
+        files->num++;
+        remaining -= padded;
+    }
+
+    /* Swallow trailing padding so the connection stays usable */
+    while (err == NULL && remaining > 0) {
+        int len = MIN(remaining, SCRATCH_BUFSIZE);
+        if (bundle_recv(req, buf, len) != 0) {
+            err = "Failed to receive bundle";
+        }
+        remaining -= len;
+    }
+
+    if (err) {
+        ESP_LOGE(TAG, "%s", err);
+        bundle_files_free(files, true);
+        free(files);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+        return ESP_FAIL;
+    }
+
+    int num = bundle_files_commit(files, base_path);
+    ESP_LOGI(TAG, "Bundle unpacked : %d files", num);
+    httpd_resp_set_type(req, "application/json");
+    if (files->num == 0) {
+        free(files);
+        snprintf(path, sizeof(path), "{\"files\":%d}", num);
+        httpd_resp_sendstr(req, path);
+        return ESP_OK;
+    }
+
+    /* Some renames failed: {"files":n,"failed":["a.lua", ...]}, the data is still in name~ */
+    ESP_LOGE(TAG, "Bundle commit failed : %d files", files->num);
+    httpd_resp_set_status(req, "500 Internal Server Error");
+    snprintf(path, sizeof(path), "{\"files\":%d,\"failed\":[", num);
+    httpd_resp_sendstr_chunk(req, path);
+    for (int x = 0; x < files->num; x++) {
+        char *end = list_json_str(buf, files->path[x] + strlen(base_path));
+        if (x + 1 < files->num) {
+            end = stpcpy(end, ",");
+        }
+        httpd_resp_send_chunk(req, buf, end - buf);
+    }
+    httpd_resp_sendstr_chunk(req, "]}");
+    httpd_resp_send_chunk(req, NULL, 0);
+    bundle_files_free(files, false);
+    free(files);
+    return ESP_OK;
+}
+
+static esp_err_t bundle_post_handler(httpd_req_t *req)
+{
+    char *buf = rest_scratch_get(req);
+    if (buf == NULL) {
+        return ESP_FAIL;
+    }
+    esp_err_t ret = bundle_post(req, buf);
+    rest_scratch_put(req, buf);
+    return ret;
+}
+
+/* Append s to a JSON string, escaping what would break the quoting */
+static char *list_json_str(char *dest, const char *s)
+{
+    *dest++ = '"';
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            *dest++ = '\\';
+        }
+        if ((unsigned char)*s >= ' ') {
+            *dest++ = *s;
+        }
+    }
+    *dest++ = '"';
+    *dest = '\0';
+    return dest;
+}
+
+/* GET /list answers [{"name":"init.lua","size":123,"md5":"..."}, ...] */
+static esp_err_t list_get(httpd_req_t *req, char *buf)
+{
+    const char *base_path = ((rest_server_context_t *)req->user_ctx)->base_path;
+    char filepath[FILE_PATH_MAX];
+    char entry[FILE_PATH_MAX * 2 + 96];
+    DIR *dir = opendir(base_path);
+    if (dir == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to open directory");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    bool first = true;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t name_len = strlen(ent->d_name);
+        if (name_len == 0 || ent->d_name[name_len - 1] == '~'
+            || snprintf(filepath, sizeof(filepath), "%s/%s", base_path, ent->d_name) >= sizeof(filepath)) {
+            continue;
+        }
+        int fd = open(filepath, O_RDONLY, 0);
+        if (fd == -1) {
+            continue;
+        }
+        struct MD5Context md5_ctx;
+        unsigned char digest[16];
+        long size = 0;
+        ssize_t read_bytes;
+        MD5Init(&md5_ctx);
+        while ((read_bytes = read(fd, buf, SCRATCH_BUFSIZE)) > 0) {
+            MD5Update(&md5_ctx, (const unsigned char *)buf, read_bytes);
+            size += read_bytes;
+        }
+        close(fd);
+        MD5Final(digest, &md5_ctx);
+
+        char *end = stpcpy(entry, first ? "[{\"name\":" : ",{\"name\":");
+        end = list_json_str(end, ent->d_name);
+        end += sprintf(end, ",\"size\":%ld,\"md5\":\"", size);
+        for (int x = 0; x < 16; x++) {
+            end += sprintf(end, "%02x", (unsigned int)digest[x]);
+        }
+        end = stpcpy(end, "\"}");
+        if (httpd_resp_send_chunk(req, entry, end - entry) != ESP_OK) {
+            closedir(dir);
+            return ESP_FAIL;
+        }
+        first = false;
+    }
+    closedir(dir);
+    httpd_resp_sendstr_chunk(req, first ? "[]" : "]");
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+static esp_err_t list_get_handler(httpd_req_t *req)
+{
+    char *buf = rest_scratch_get(req);
+    if (buf == NULL) {
+        return ESP_FAIL;
+    }
+    esp_err_t ret = list_get(req, buf);
+    rest_scratch_put(req, buf);
+    return ret;
+}
+
+/* Routes added from Lua with httpd.on() live in a table sorted by method
+ * and URI. The /* handlers look a request up there with bsearch() before
+ * falling back to static files, so nothing is registered with the server
+ * per route and lookup stays O(log n) as the table grows. */
+#define HTTPD_ROUTE_NUM 32
+#define HTTPD_HANDLERS "esp_lib_httpd.handlers"
+
+#ifndef HTTPD_LUA_TIMEOUT_MS
+#define HTTPD_LUA_TIMEOUT_MS (5000)
+#endif
+
+/* Handlers live in the HTTPD_HANDLERS registry table keyed by "METHOD uri",
+ * a queued request looks its function up by that key when it is dispatched,
+ * so replacing a route never leaves it holding a stale reference */
+typedef struct {
+    httpd_method_t method;
+    const char *method_str;
+    char *uri;
+} httpd_route_t;
+
+static httpd_route_t httpd_routes[HTTPD_ROUTE_NUM] = {0};
+static int httpd_route_num = 0;
+static SemaphoreHandle_t httpd_route_lock = NULL;
+
+static int lua_route_cmp(const void *a, const void *b)
+{
+    const httpd_route_t *ra = (const httpd_route_t *)a;
+    const httpd_route_t *rb = (const httpd_route_t *)b;
+    if (ra->method != rb->method) {
+        return (ra->method < rb->method) ? -1 : 1;
+    }
+    return strcmp(ra->uri, rb->uri);
+}
+
+/* Copy out the route matching req, ignoring any query string */
+static bool lua_route_find(httpd_req_t *req, httpd_route_t *found)
+{
+    char path[sizeof(req->uri)];
+    strlcpy(path, req->uri, MIN(sizeof(path), strcspn(req->uri, "?#") + 1));
+    httpd_route_t key = {
+        .method = req->method,
+        .uri = path,
     };
-    httpd_register_uri_handler(server, &common_get_uri);
 
-    httpd_uri_t common_post_uri = {
-        .uri = "/*",
-        .method = HTTP_POST,
-        .handler = rest_common_post_handler,
-        .user_ctx = rest_context
+    xSemaphoreTake(httpd_route_lock, portMAX_DELAY);
+    httpd_route_t *route = bsearch(&key, httpd_routes, httpd_route_num, sizeof(httpd_route_t), lua_route_cmp);
+    if (route) {
+        *found = *route;
+        found->uri = NULL;
+    }
+    xSemaphoreGive(httpd_route_lock);
+    return route != NULL;
+}
+
+/* Status line for a handler's status code, buf holds it when there is no fixed
+ * string and must outlive the response */
+static const char *httpd_status_str(int status, char *buf, size_t len)
+{
+    static const char *const reasons[] = {"Informational", "Success", "Redirection", "Client Error", "Server Error"};
+    switch (status) {
+        case 200: return "200 OK";
+        case 201: return "201 Created";
+        case 202: return "202 Accepted";
+        case 204: return "204 No Content";
+        case 301: return "301 Moved Permanently";
+        case 302: return "302 Found";
+        case 304: return "304 Not Modified";
+        case 400: return "400 Bad Request";
+        case 401: return "401 Unauthorized";
+        case 403: return "403 Forbidden";
+        case 404: return "404 Not Found";
+        case 405: return "405 Method Not Allowed";
+        case 409: return "409 Conflict";
+        case 503: return "503 Service Unavailable";
+        case 504: return "504 Gateway Timeout";
+        default: break;
+    }
+    if (status < 100 || status > 599) {
+        return "500 Internal Server Error";
+    }
+    snprintf(buf, len, "%d %s", status, reasons[status / 100 - 1]);
+    return buf;
+}
+
+/* Hand the request to the Lua task and send whatever its handler returns */
+static esp_err_t lua_route_handler(httpd_req_t *req, httpd_route_t *route)
+{
+    char status_line[32];
+    int total_len = req->content_len;
+    int cur_len = 0;
+    if (total_len >= SCRATCH_BUFSIZE) {
+        /* Respond with 500 Internal Server Error */
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "content too long");
+        return ESP_FAIL;
+    }
+
+    httpd_pending_t *p = calloc(1, sizeof(httpd_pending_t));
+    httpd_event_t e = {
+        .event = "HTTPD_REQUEST_EVENT",
+        .uri = strdup(req->uri),
+        .data = malloc(total_len + 1),
+        .data_len = total_len,
     };
-    httpd_register_uri_handler(server, &common_post_uri);
+    int path_len = strcspn(req->uri, "?#");
+    if (p) {
+        p->done = xSemaphoreCreateBinary();
+        p->route = malloc(strlen(route->method_str) + path_len + 2);
+    }
+    if (p == NULL || p->done == NULL || p->route == NULL || e.uri == NULL || e.data == NULL) {
+        if (p && p->done) {
+            vSemaphoreDelete(p->done);
+        }
+        if (p) {
+            free(p->route);
+        }
+        free(p);
+        httpd_event_free(&e);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
+        return ESP_FAIL;
+    }
+    p->refs = 2;
+    sprintf(p->route, "%s %.*s", route->method_str, path_len, req->uri);
+    p->method = route->method_str;
+    e.pending = p;
+
+    while (cur_len < total_len) {
+        int received = httpd_req_recv(req, e.data + cur_len, total_len - cur_len);
+        if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+            continue;
+        }
+        if (received <= 0) {
+            httpd_event_free(&e);
+            httpd_pending_put(p);
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive request");
+            return ESP_FAIL;
+        }
+        cur_len += received;
+    }
+    e.data[total_len] = '\0';
+
+    /* Queueing and running the handler share one HTTPD_LUA_TIMEOUT_MS budget */
+    TickType_t timeout = HTTPD_LUA_TIMEOUT_MS / portTICK_PERIOD_MS;
+    TickType_t start = xTaskGetTickCount();
+    if (httpd_event_post_wait(&e, true, timeout) != 0) {
+        httpd_pending_put(p);
+        httpd_resp_set_status(req, httpd_status_str(503, status_line, sizeof(status_line)));
+        httpd_resp_sendstr(req, "Server busy");
+        return ESP_OK;
+    }
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    if (xSemaphoreTake(p->done, (elapsed < timeout) ? timeout - elapsed : 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Lua handler timeout for %s", req->uri);
+        httpd_pending_put(p);
+        httpd_resp_set_status(req, httpd_status_str(504, status_line, sizeof(status_line)));
+        httpd_resp_sendstr(req, "Lua handler timeout");
+        return ESP_OK;
+    }
+
+    httpd_resp_set_status(req, httpd_status_str(p->status, status_line, sizeof(status_line)));
+    const char *header = p->headers;
+    for (int x = 0; x < p->header_num; x++) {
+        const char *value = header + strlen(header) + 1;
+        if (strcasecmp(header, "Content-Type") == 0) {
+            httpd_resp_set_type(req, value);
+        } else {
+            httpd_resp_set_hdr(req, header, value);
+        }
+        header = value + strlen(value) + 1;
+    }
+    esp_err_t ret = httpd_resp_send(req, p->body ? p->body : "", p->body_len);
+    httpd_pending_put(p);
+    return ret;
+}
+
+static void httpd_handlers_get(lua_State *L)
+{
+    if (lua_getfield(L, LUA_REGISTRYINDEX, HTTPD_HANDLERS) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, HTTPD_HANDLERS);
+    }
+}
+
+/* Copy the handler results {status, body, headers} at the top of the stack into p */
+static void httpd_pending_fill(lua_State *L, httpd_pending_t *p)
+{
+    size_t len = 0;
+    const char *body = NULL;
+
+    p->status = lua_isinteger(L, -3) ? lua_tointeger(L, -3) : 200;
+    if (lua_type(L, -2) == LUA_TSTRING) {
+        body = lua_tolstring(L, -2, &len);
+    }
+    if (body && (p->body = malloc(len)) != NULL) {
+        memcpy(p->body, body, len);
+        p->body_len = len;
+    }
+
+    if (lua_istable(L, -1)) {
+        size_t size = 0;
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0) {
+            if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1)) {
+                size += strlen(lua_tostring(L, -2)) + strlen(lua_tostring(L, -1)) + 2;
+            }
+            lua_pop(L, 1);
+        }
+        p->headers = size ? malloc(size) : NULL;
+        char *header = p->headers;
+        lua_pushnil(L);
+        while (header && lua_next(L, -2) != 0) {
+            if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1)) {
+                header = stpcpy(header, lua_tostring(L, -2)) + 1;
+                header = stpcpy(header, lua_tostring(L, -1)) + 1;
+                p->header_num++;
+            }
+            lua_pop(L, 1);
+        }
+    }
+}
+
+/* Run the Lua handler of a routed request and release the waiting server task */
+static void httpd_event_dispatch(lua_State *L, httpd_event_t *e)
+{
+    httpd_pending_t *p = e->pending;
+
+    httpd_handlers_get(L);
+    lua_getfield(L, -1, p->route);
+    lua_remove(L, -2);
+    lua_newtable(L);
+    lua_pushstring(L, "method");
+    lua_pushstring(L, p->method);
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "uri");
+    lua_pushstring(L, e->uri);
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "data");
+    lua_pushlstring(L, e->data, e->data_len);
+    lua_settable(L,-3);
+
+    /* A Lua error must still answer the request, so don't let it unwind past us */
+    if (lua_pcall(L, 1, 3, 0) != LUA_OK) {
+        ESP_LOGE(TAG, "Handler for %s failed: %s", e->uri, lua_tostring(L, -1));
+        p->status = 500;
+        lua_pop(L, 1);
+    } else {
+        httpd_pending_fill(L, p);
+        lua_pop(L, 3);
+    }
+    xSemaphoreGive(p->done);
+    httpd_event_free(e);
+}
+
+static esp_err_t rest_route_get_handler(httpd_req_t *req)
+{
+    httpd_route_t route;
+    if (lua_route_find(req, &route)) {
+        return lua_route_handler(req, &route);
+    }
+    return rest_common_get_handler(req);
+}
+
+static esp_err_t rest_route_post_handler(httpd_req_t *req)
+{
+    httpd_route_t route;
+    if (lua_route_find(req, &route)) {
+        return lua_route_handler(req, &route);
+    }
+    return rest_common_post_handler(req);
+}
+
+/* PUT and DELETE only exist as Lua routes */
+static esp_err_t rest_route_other_handler(httpd_req_t *req)
+{
+    httpd_route_t route;
+    if (lua_route_find(req, &route)) {
+        return lua_route_handler(req, &route);
+    }
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No route");
+    return ESP_FAIL;
+}
+
+/* Catch-all handlers, registered last since esp_http_server matches in registration order */
+static void rest_register_common(rest_server_context_t *rest_context)
+{
+    static const struct {
+        httpd_method_t method;
+        esp_err_t (*handler)(httpd_req_t *r);
+    } common[] = {
+        {HTTP_GET, rest_route_get_handler},
+        {HTTP_POST, rest_route_post_handler},
+        {HTTP_PUT, rest_route_other_handler},
+        {HTTP_DELETE, rest_route_other_handler},
+    };
+
+    for (int x = 0; x < sizeof(common) / sizeof(common[0]); x++) {
+        httpd_uri_t common_uri = {
+            .uri = "/*",
+            .method = common[x].method,
+            .handler = common[x].handler,
+            .user_ctx = rest_context
+        };
+        httpd_register_uri_handler(server, &common_uri);
+    }
+}
+
+static void lua_routes_free()
+{
+    xSemaphoreTake(httpd_route_lock, portMAX_DELAY);
+    for (int x = 0; x < httpd_route_num; x++) {
+        free(httpd_routes[x].uri);
+    }
+    memset(httpd_routes, 0, sizeof(httpd_routes));
+    httpd_route_num = 0;
+    xSemaphoreGive(httpd_route_lock);
+}
+
+/* WebSocket endpoint, frames from browsers arrive as HTTPD_WS_EVENT and
+ * httpd.ws_send() pushes to one or all clients over a single connection.
+ * The client list is only touched from the server task: handlers, the
+ * close hook and work queued with httpd_queue_work(). */
+#define HTTPD_WS_URI "/ws"
+#define HTTPD_WS_CLIENT_NUM 8
+
+#if CONFIG_HTTPD_WS_SUPPORT
+static int httpd_ws_fds[HTTPD_WS_CLIENT_NUM] = {0};
+
+typedef struct {
+    int fd;
+    httpd_ws_type_t type;
+    size_t len;
+    uint8_t data[];
+} httpd_ws_work_t;
+
+static void httpd_ws_client_del(int fd)
+{
+    for (int x = 0; x < HTTPD_WS_CLIENT_NUM; x++) {
+        if (httpd_ws_fds[x] == fd) {
+            httpd_ws_fds[x] = 0;
+            httpd_event_t e = {
+                .event = "HTTPD_WS_CLOSE_EVENT",
+                .uri = strdup(HTTPD_WS_URI),
+                .data = strdup(""),
+                .fd = fd,
+            };
+            httpd_event_post(&e, false);
+        }
+    }
+}
+
+static void httpd_ws_client_add(int fd)
+{
+    for (int x = 0; x < HTTPD_WS_CLIENT_NUM; x++) {
+        if (httpd_ws_fds[x] == 0 || httpd_ws_fds[x] == fd) {
+            httpd_ws_fds[x] = fd;
+            httpd_event_t e = {
+                .event = "HTTPD_WS_OPEN_EVENT",
+                .uri = strdup(HTTPD_WS_URI),
+                .data = strdup(""),
+                .fd = fd,
+            };
+            httpd_event_post(&e, false);
+            return;
+        }
+    }
+    ESP_LOGW(TAG, "Too many websocket clients, %d not tracked", fd);
+}
+
+static esp_err_t ws_handler(httpd_req_t *req)
+{
+    int fd = httpd_req_to_sockfd(req);
+    if (req->method == HTTP_GET) {
+        /* Handshake done by the server, from now on frames come through here */
+        httpd_ws_client_add(fd);
+        return ESP_OK;
+    }
+
+    httpd_ws_frame_t frame;
+    memset(&frame, 0, sizeof(httpd_ws_frame_t));
+    esp_err_t ret = httpd_ws_recv_frame(req, &frame, 0);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (frame.len >= SCRATCH_BUFSIZE) {
+        ESP_LOGE(TAG, "Websocket frame too long : %d bytes", frame.len);
+        return ESP_FAIL;
+    }
+    httpd_event_t e = {
+        .event = "HTTPD_WS_EVENT",
+        .uri = strdup(HTTPD_WS_URI),
+        .data = malloc(frame.len + 1),
+        .data_len = frame.len,
+        .fd = fd,
+    };
+    if (e.uri == NULL || e.data == NULL) {
+        httpd_event_free(&e);
+        return ESP_ERR_NO_MEM;
+    }
+    frame.payload = (uint8_t *)e.data;
+    if (frame.len && (ret = httpd_ws_recv_frame(req, &frame, frame.len)) != ESP_OK) {
+        httpd_event_free(&e);
+        return ret;
+    }
+    e.data[frame.len] = '\0';
+
+    if (frame.type == HTTPD_WS_TYPE_CLOSE) {
+        httpd_event_free(&e);
+        httpd_ws_client_del(fd);
+        return ESP_OK;
+    }
+    if (frame.type != HTTPD_WS_TYPE_TEXT && frame.type != HTTPD_WS_TYPE_BINARY) {
+        httpd_event_free(&e);
+        return ESP_OK;
+    }
+    httpd_event_post(&e, false);
+    return ESP_OK;
+}
+
+static void httpd_ws_send_work(void *arg)
+{
+    httpd_ws_work_t *work = (httpd_ws_work_t *)arg;
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = work->type,
+        .payload = work->data,
+        .len = work->len,
+    };
+    for (int x = 0; x < HTTPD_WS_CLIENT_NUM; x++) {
+        int fd = httpd_ws_fds[x];
+        if (fd == 0 || (work->fd > 0 && work->fd != fd)) {
+            continue;
+        }
+        if (httpd_ws_get_fd_info(server, fd) != HTTPD_WS_CLIENT_WEBSOCKET
+            || httpd_ws_send_frame_async(server, fd, &frame) != ESP_OK) {
+            httpd_ws_client_del(fd);
+        }
+    }
+    free(work);
+}
+#endif
+
+/* Server-Sent Events, GET /events?channel=name answers with a chunked
+ * text/event-stream and never finishes it, the socket is kept and
+ * httpd.push() writes further chunks to it from the server task. Every
+ * stream holds one of max_open_sockets for good, so HTTPD_SSE_SOCKET_RESERVE
+ * of them are always left to ordinary requests */
+#define HTTPD_SSE_URI "/events"
+#define HTTPD_SSE_CLIENT_NUM 8
+#define HTTPD_SSE_CHANNEL_MAX 32
+#define HTTPD_SSE_SOCKET_RESERVE 3
+
+typedef struct {
+    int fd;
+    char channel[HTTPD_SSE_CHANNEL_MAX];
+} httpd_sse_client_t;
+
+static httpd_sse_client_t httpd_sse_clients[HTTPD_SSE_CLIENT_NUM] = {0};
+static int httpd_sse_client_max = 0;
+
+typedef struct {
+    char channel[HTTPD_SSE_CHANNEL_MAX];
+    size_t len;
+    char data[];
+} httpd_sse_work_t;
+
+static void httpd_sse_event(const char *event, httpd_sse_client_t *client)
+{
+    httpd_event_t e = {
+        .event = event,
+        .uri = strdup(HTTPD_SSE_URI),
+        .data = strdup(client->channel),
+        .data_len = strlen(client->channel),
+        .fd = client->fd,
+    };
+    httpd_event_post(&e, false);
+}
+
+static void httpd_sse_client_del(int fd)
+{
+    for (int x = 0; x < HTTPD_SSE_CLIENT_NUM; x++) {
+        if (httpd_sse_clients[x].fd == fd) {
+            httpd_sse_event("HTTPD_SSE_CLOSE_EVENT", &httpd_sse_clients[x]);
+            httpd_sse_clients[x].fd = 0;
+        }
+    }
+}
+
+static esp_err_t sse_handler(httpd_req_t *req)
+{
+    char channel[HTTPD_SSE_CHANNEL_MAX] = "";
+    size_t len = httpd_req_get_url_query_len(req);
+    if (len > 0) {
+        char *query = malloc(len + 1);
+        if (query && httpd_req_get_url_query_str(req, query, len + 1) == ESP_OK) {
+            httpd_query_key_value(query, "channel", channel, sizeof(channel));
+        }
+        free(query);
+    }
+
+    httpd_sse_client_t *client = NULL;
+    int used = 0;
+    for (int x = 0; x < HTTPD_SSE_CLIENT_NUM; x++) {
+        if (httpd_sse_clients[x].fd != 0) {
+            used++;
+        } else if (client == NULL) {
+            client = &httpd_sse_clients[x];
+        }
+    }
+    if (client == NULL || used >= httpd_sse_client_max) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_sendstr(req, "Too many event streams");
+        return ESP_OK;
+    }
+
+    httpd_resp_set_type(req, "text/event-stream");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    /* The first chunk flushes the headers, leaving the response open */
+    if (httpd_resp_sendstr_chunk(req, ": ok\n\n") != ESP_OK) {
+        return ESP_FAIL;
+    }
+    client->fd = httpd_req_to_sockfd(req);
+    strlcpy(client->channel, channel, sizeof(client->channel));
+    httpd_sse_event("HTTPD_SSE_OPEN_EVENT", client);
+    return ESP_OK;
+}
+
+static void httpd_sse_push_work(void *arg)
+{
+    httpd_sse_work_t *work = (httpd_sse_work_t *)arg;
+
+    /* Every line of data gets its own "data: " field, the event ends with a blank line */
+    size_t lines = 1;
+    for (size_t x = 0; x < work->len; x++) {
+        lines += (work->data[x] == '\n');
+    }
+    size_t size = 16 + work->len + lines * (sizeof("data: \n") - 1) + 5;
+    char *chunk = malloc(size);
+    if (chunk == NULL) {
+        free(work);
+        return;
+    }
+    char *body = chunk + 16;
+    char *end = stpcpy(body, "data: ");
+    for (size_t x = 0; x < work->len; x++) {
+        if (work->data[x] == '\n') {
+            end = stpcpy(end, "\ndata: ");
+        } else {
+            *end++ = work->data[x];
+        }
+    }
+    end = stpcpy(end, "\n\n\r\n");
+    /* Frame it as one HTTP chunk, the size line goes right before the body */
+    char head[16];
+    int head_len = sprintf(head, "%x\r\n", (unsigned int)(end - body - 2));
+    char *start = body - head_len;
+    memcpy(start, head, head_len);
+
+    for (int x = 0; x < HTTPD_SSE_CLIENT_NUM; x++) {
+        httpd_sse_client_t *client = &httpd_sse_clients[x];
+        if (client->fd == 0 || strcmp(client->channel, work->channel) != 0) {
+            continue;
+        }
+        if (httpd_socket_send(server, client->fd, start, end - start, 0) < 0) {
+            int fd = client->fd;
+            httpd_sse_client_del(fd);
+            httpd_sess_trigger_close(server, fd);
+        }
+    }
+    free(chunk);
+    free(work);
+}
+
+// [true, false] = httpd.push(channel, data) -- to every GET /events?channel=channel stream
+static int http_server_push(lua_State *L) 
+{
+    size_t len = 0;
+    const char *channel = luaL_checklstring(L, 1, NULL);
+    const char *data = luaL_checklstring(L, 2, &len);
+
+    if (server == NULL) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    httpd_sse_work_t *work = (httpd_sse_work_t *)malloc(sizeof(httpd_sse_work_t) + len);
+    if (work == NULL) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    strlcpy(work->channel, channel, sizeof(work->channel));
+    work->len = len;
+    memcpy(work->data, data, len);
+    if (httpd_queue_work(server, httpd_sse_push_work, work) != ESP_OK) {
+        free(work);
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+/* Sockets closing for any reason, clients that just went away included */
+static void httpd_sock_close(httpd_handle_t hd, int fd)
+{
+#if CONFIG_HTTPD_WS_SUPPORT
+    httpd_ws_client_del(fd);
+#endif
+    httpd_sse_client_del(fd);
+    close(fd);
+}
+
+// [true, false] = httpd.ws_send(data[, fd[, binary]]) -- all websocket clients without fd
+static int http_server_ws_send(lua_State *L) 
+{
+    size_t len = 0;
+    const char *data = luaL_checklstring(L, 1, &len);
+    int fd = luaL_optinteger(L, 2, 0);
+    bool binary = lua_toboolean(L, 3);
+
+#if CONFIG_HTTPD_WS_SUPPORT
+    if (server == NULL) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    httpd_ws_work_t *work = (httpd_ws_work_t *)malloc(sizeof(httpd_ws_work_t) + len);
+    if (work == NULL) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    work->fd = fd;
+    work->type = binary ? HTTPD_WS_TYPE_BINARY : HTTPD_WS_TYPE_TEXT;
+    work->len = len;
+    memcpy(work->data, data, len);
+    if (httpd_queue_work(server, httpd_ws_send_work, work) != ESP_OK) {
+        free(work);
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    lua_pushboolean(L, true);
+#else
+    (void)data;
+    (void)fd;
+    (void)binary;
+    ESP_LOGW(TAG, "Websocket support is disabled, enable CONFIG_HTTPD_WS_SUPPORT");
+    lua_pushboolean(L, false);
+#endif
+    return 1;
+}
+
+esp_err_t start_rest_server(const char *base_path)
+{
+    REST_CHECK(base_path, "wrong base path", err);
+    rest_server_context_t *rest_context = rest_context_create(base_path);
+    REST_CHECK(rest_context, "No memory for rest context", err);
+    if (httpd_cache_lock == NULL) {
+        httpd_cache_lock = xSemaphoreCreateMutex();
+    }
+    REST_CHECK(httpd_cache_lock, "No memory for cache lock", err_start);
+    if (httpd_pending_lock == NULL) {
+        httpd_pending_lock = xSemaphoreCreateMutex();
+    }
+    REST_CHECK(httpd_pending_lock, "No memory for pending lock", err_start);
+    if (httpd_route_lock == NULL) {
+        httpd_route_lock = xSemaphoreCreateMutex();
+    }
+    REST_CHECK(httpd_route_lock, "No memory for route lock", err_start);
+
+    httpd_mime_table_check();
+
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.uri_match_fn = httpd_uri_match_wildcard;
+    /* upload, delete, bundle, list, ws, events and the four catch-alls */
+    config.max_uri_handlers = 10;
+    /* httpd_stop() releases the context and its scratch pool */
+    config.global_user_ctx = rest_context;
+    config.global_user_ctx_free_fn = rest_context_free;
+    config.close_fn = httpd_sock_close;
+
+    ESP_LOGI(TAG, "Starting HTTP Server");
+    REST_CHECK(httpd_start(&server, &config) == ESP_OK, "Start server failed", err_start);
+
+    /* URI handler for uploading files to server */
+    httpd_uri_t file_upload = {
+        .uri       = "/upload/*",   // Match all URIs of type /upload/path/to/file
+        .method    = HTTP_POST,
+        .handler   = upload_post_handler,
+        .user_ctx  = rest_context    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &file_upload);
+
+    /* URI handler for deleting files from server */
+    httpd_uri_t file_delete = {
+        .uri       = "/delete/*",   // Match all URIs of type /delete/path/to/file
+        .method    = HTTP_GET,
+        .handler   = delete_post_handler,
+        .user_ctx  = rest_context    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &file_delete);
+
+    /* URI handler for unpacking a tar of files onto the server */
+    httpd_uri_t file_bundle = {
+        .uri       = "/bundle",
+        .method    = HTTP_POST,
+        .handler   = bundle_post_handler,
+        .user_ctx  = rest_context
+    };
+    httpd_register_uri_handler(server, &file_bundle);
+
+    /* URI handler for listing files with size and MD5 as JSON */
+    httpd_uri_t file_list = {
+        .uri       = "/list",
+        .method    = HTTP_GET,
+        .handler   = list_get_handler,
+        .user_ctx  = rest_context
+    };
+    httpd_register_uri_handler(server, &file_list);
+
+#if CONFIG_HTTPD_WS_SUPPORT
+    memset(httpd_ws_fds, 0, sizeof(httpd_ws_fds));
+    httpd_uri_t ws = {
+        .uri        = HTTPD_WS_URI,
+        .method     = HTTP_GET,
+        .handler    = ws_handler,
+        .user_ctx   = rest_context,
+        .is_websocket = true
+    };
+    httpd_register_uri_handler(server, &ws);
+#endif
+
+    memset(httpd_sse_clients, 0, sizeof(httpd_sse_clients));
+    httpd_sse_client_max = MIN(HTTPD_SSE_CLIENT_NUM, MAX(1, (int)config.max_open_sockets - HTTPD_SSE_SOCKET_RESERVE));
+    httpd_uri_t sse = {
+        .uri        = HTTPD_SSE_URI,
+        .method     = HTTP_GET,
+        .handler    = sse_handler,
+        .user_ctx   = rest_context
+    };
+    httpd_register_uri_handler(server, &sse);
+
+    rest_register_common(rest_context);
 
     return ESP_OK;
 err_start:
-    free(rest_context);
+    rest_context_free(rest_context);
 err:
     return ESP_FAIL;
 }
@@ -432,18 +2132,19 @@ static int stop_rest_server()
     int ret = -1;
     ret = httpd_stop(server);
     mdns_free();
+    httpd_cache_invalidate(NULL);
     httpd_event_t e;
     while (1) {
         if (xQueueReceive(httpd_event_queue, (void *)&e, 0) == pdTRUE) {
-            free(e.event);
-            free(e.uri);
-            free(e.data);
+            httpd_event_free(&e);
         } else{
             break;
         }
     }
     vQueueDelete(httpd_event_queue);
+    httpd_event_queue = NULL;
     server = NULL;
+    lua_routes_free();
 
     return ret;
 }
@@ -463,15 +2164,21 @@ static int initialise_mdns(char *name)
                                      sizeof(serviceTxtData) / sizeof(serviceTxtData[0]));
 }
 
+// [true, false] = httpd.start(name[, basepath[, {queue = 100, policy = 'drop_newest' | 'drop_oldest' | 'block', block_ms = 10}]])
 static int http_server_start(lua_State *L) 
 {
     int ret = -1;
+    esp_lua_queue_t conf;
 
+    esp_lua_queue_opts(L, 3, &conf, HTTPD_EVENT_QUEUE_NUM);
     if (server != NULL) {
         ret = stop_rest_server();
     }
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, HTTPD_HANDLERS);
     initialise_mdns(luaL_checklstring(L, 1, NULL));
-    httpd_event_queue = xQueueCreate(HTTPD_EVENT_QUEUE_NUM, sizeof(httpd_event_t));
+    httpd_event_conf = conf;
+    httpd_event_queue = xQueueCreate(httpd_event_conf.depth, sizeof(httpd_event_t));
     char *basepath = "/lua";
     if (lua_tostring(L, 2) != NULL) {
         basepath = lua_tostring(L, 2);
@@ -482,29 +2189,76 @@ static int http_server_start(lua_State *L)
     return 1;
 }
 
+static void httpd_event_push(lua_State *L, httpd_event_t *e)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "event");
+    lua_pushstring(L, e->event);
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "uri");
+    lua_pushstring(L, e->uri);
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "data");
+    lua_pushlstring(L, e->data, e->data_len);
+    lua_settable(L,-3);
+
+    if (e->fd > 0) {
+        lua_pushstring(L, "fd");
+        lua_pushinteger(L, e->fd);
+        lua_settable(L,-3);
+    }
+
+    if (e->total > 0) {
+        lua_pushstring(L, "offset");
+        lua_pushinteger(L, e->offset);
+        lua_settable(L,-3);
+
+        lua_pushstring(L, "total");
+        lua_pushinteger(L, e->total);
+        lua_settable(L,-3);
+    }
+
+    httpd_event_free(e);
+}
+
+/* Push the next event that has no Lua route, answering routed requests on the way */
+static int httpd_event_next(lua_State *L, TickType_t ticks)
+{
+    httpd_event_t e;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = ticks;
+
+    while (server != NULL && xQueueReceive(httpd_event_queue, (void *)&e, wait) == pdTRUE) {
+        if (e.pending == NULL) {
+            httpd_event_push(L, &e);
+            return 1;
+        }
+
+        httpd_event_dispatch(L, &e);
+
+        if (ticks != portMAX_DELAY) {
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            wait = (elapsed >= ticks) ? 0 : ticks - elapsed;
+        }
+    }
+    return 0;
+}
+
+static int httpd_event_source(lua_State *L)
+{
+    return httpd_event_next(L, 0);
+}
+
+// [{event, uri, data[, fd, offset, total]}, false] = httpd.run([timeout_ms]) -- requests matching httpd.on() routes are answered, not returned
 static int http_server_run(lua_State *L) 
 {
     int ret = -1;
 
-    httpd_event_t e;
+    TickType_t ticks = ESP_LUA_TIMEOUT_TICKS(luaL_optinteger(L, 1, 0));
     if (server != NULL) {
-        if (xQueueReceive(httpd_event_queue, (void *)&e, 0) == pdTRUE) {
-            lua_newtable(L);
-            lua_pushstring(L, "event");
-            lua_pushstring(L, e.event);
-            lua_settable(L,-3);
-
-            lua_pushstring(L, "uri");
-            lua_pushstring(L, e.uri);
-            lua_settable(L,-3);
-
-            lua_pushstring(L, "data");
-            lua_pushstring(L, e.data);
-            lua_settable(L,-3);
-
-            free(e.event);
-            free(e.uri);
-            free(e.data);
+        if (httpd_event_next(L, ticks) == 1) {
             return 1;
         } else {
             ret = -1;
@@ -515,6 +2269,66 @@ static int http_server_run(lua_State *L)
     return 1;
 }
 
+// [true, false] = httpd.on('GET' | 'POST' | 'PUT' | 'DELETE', uri, function(req) return status, body[, headers] end)
+// req = {method, uri, data}, headers = {['Content-Type'] = 'application/json', ...}
+static int http_server_on(lua_State *L) 
+{
+    static const char *const methods[] = {"GET", "POST", "PUT", "DELETE", NULL};
+    static const httpd_method_t method_ids[] = {HTTP_GET, HTTP_POST, HTTP_PUT, HTTP_DELETE};
+    int method = luaL_checkoption(L, 1, NULL, methods);
+    const char *uri = luaL_checklstring(L, 2, NULL);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+
+    if (server == NULL) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    int ret = -1;
+    httpd_route_t key = {
+        .method = method_ids[method],
+        .uri = (char *)uri,
+    };
+    xSemaphoreTake(httpd_route_lock, portMAX_DELAY);
+    httpd_route_t *route = bsearch(&key, httpd_routes, httpd_route_num, sizeof(httpd_route_t), lua_route_cmp);
+    if (route) {
+        /* Same route again, only the function changes */
+        ret = 0;
+    } else if (httpd_route_num < HTTPD_ROUTE_NUM && (key.uri = strdup(uri)) != NULL) {
+        key.method_str = methods[method];
+        httpd_routes[httpd_route_num++] = key;
+        qsort(httpd_routes, httpd_route_num, sizeof(httpd_route_t), lua_route_cmp);
+        ret = 0;
+    }
+    xSemaphoreGive(httpd_route_lock);
+
+    if (ret == 0) {
+        httpd_handlers_get(L);
+        lua_pushfstring(L, "%s %s", methods[method], uri);
+        lua_pushvalue(L, 3);
+        lua_settable(L, -3);
+        lua_pop(L, 1);
+    }
+
+    lua_pushboolean(L, (ret == 0) ? true : false);
+    return 1;
+}
+
+// [true] = httpd.invalidate([path]) -- drop path, or every file, from the static file cache
+static int http_server_invalidate(lua_State *L) 
+{
+    httpd_cache_invalidate(luaL_optstring(L, 1, NULL));
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// {depth, waiting, enqueued, dropped, high_water} = httpd.stats()
+static int http_server_stats(lua_State *L) 
+{
+    esp_lua_queue_stats(L, &httpd_event_conf, httpd_event_queue ? uxQueueMessagesWaiting(httpd_event_queue) : 0);
+    return 1;
+}
+
 static int http_server_stop(lua_State *L) 
 {
     int ret = -1;
@@ -522,6 +2336,8 @@ static int http_server_stop(lua_State *L)
     if (server != NULL) {
         ret = stop_rest_server();
     }
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, HTTPD_HANDLERS);
 
     lua_pushboolean(L, (ret == ESP_OK) ? true : false);
     return 1;
@@ -530,12 +2346,18 @@ static int http_server_stop(lua_State *L)
 static const luaL_Reg httpd_lib[] = {
     {"start",   http_server_start},
     {"run",   http_server_run},
+    {"on",   http_server_on},
+    {"ws_send",   http_server_ws_send},
+    {"push",   http_server_push},
+    {"stats",   http_server_stats},
+    {"invalidate",   http_server_invalidate},
     {"stop",   http_server_stop},
     {NULL, NULL}
 };
 
 LUAMOD_API int esp_lib_httpd(lua_State *L) 
 {
+    esp_lua_event_source_add(httpd_event_source);
     luaL_newlib(L, httpd_lib);
     lua_pushstring(L, "0.1.0");
     lua_setfield(L, -2, "_version");
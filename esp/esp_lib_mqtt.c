@@ -1,6 +1,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
@@ -13,93 +14,239 @@
 
 static const char *TAG = "esp_lib_mqtt";
 
+#if CONFIG_SPIRAM
 #define MQTT_EVENT_QUEUE_NUM 100
+#define MQTT_EVENT_DATA_SIZE 1024
+#else
+#define MQTT_EVENT_QUEUE_NUM 32
+#define MQTT_EVENT_DATA_SIZE 256
+#endif
+#define MQTT_EVENT_TOPIC_SIZE 64
 
 static esp_mqtt_client_handle_t client = NULL;
-static QueueHandle_t mqtt_event_queue = NULL;
 
+/* Events live in a fixed pool of slots allocated once in mqtt.start.
+ * The handler copies topic and data straight into a free slot and
+ * queues a pointer to it; mqtt.run builds the Lua strings from the
+ * slot and hands it back. Only payloads larger than the inline
+ * buffers fall back to the heap. */
 typedef struct {
-    char *event;
+    const char *event;
     char *topic;
+    int topic_len;
     char *data;
+    int data_len;
+    char topic_buf[MQTT_EVENT_TOPIC_SIZE];
+    char data_buf[MQTT_EVENT_DATA_SIZE];
 } mqtt_event_t;
 
-static int mqtt_event_send(char *event, char *topic, char *data)
-{
-    mqtt_event_t e;
+static esp_lua_queue_t mqtt_event_conf = {0};
+static mqtt_event_t *mqtt_event_pool = NULL;
+static QueueHandle_t mqtt_event_queue = NULL;
+static QueueHandle_t mqtt_event_free = NULL;
+static mqtt_event_t *mqtt_event_partial = NULL;
 
-    if (event) {
-        e.event = calloc(sizeof(char), strlen(event) + 1);
-        strcpy(e.event, event);
-    } else {
+static int mqtt_event_pool_init(int num)
+{
+    mqtt_event_pool = calloc(num, sizeof(mqtt_event_t));
+    mqtt_event_queue = xQueueCreate(num, sizeof(mqtt_event_t *));
+    mqtt_event_free = xQueueCreate(num, sizeof(mqtt_event_t *));
+    if (mqtt_event_pool == NULL || mqtt_event_queue == NULL || mqtt_event_free == NULL) {
+        ESP_LOGE(TAG, "No memory for event pool");
         return -1;
     }
 
+    for (int x = 0; x < num; x++) {
+        mqtt_event_t *e = &mqtt_event_pool[x];
+        xQueueSend(mqtt_event_free, (void *)&e, 0);
+    }
+    return 0;
+}
+
+static void mqtt_event_release(mqtt_event_t *e)
+{
+    if (e->topic != e->topic_buf) {
+        free(e->topic);
+    }
+    if (e->data != e->data_buf) {
+        free(e->data);
+    }
+    e->topic = NULL;
+    e->data = NULL;
+    xQueueSend(mqtt_event_free, (void *)&e, 0);
+}
+
+static void mqtt_event_pool_deinit()
+{
+    mqtt_event_t *e;
+    if (mqtt_event_partial) {
+        mqtt_event_release(mqtt_event_partial);
+        mqtt_event_partial = NULL;
+    }
+    if (mqtt_event_queue) {
+        while (xQueueReceive(mqtt_event_queue, (void *)&e, 0) == pdTRUE) {
+            mqtt_event_release(e);
+        }
+        vQueueDelete(mqtt_event_queue);
+    }
+    if (mqtt_event_free) {
+        vQueueDelete(mqtt_event_free);
+    }
+    free(mqtt_event_pool);
+    mqtt_event_queue = NULL;
+    mqtt_event_free = NULL;
+    mqtt_event_pool = NULL;
+}
+
+static char *mqtt_event_buf(char *buf, size_t size, int len)
+{
+    if (len > size) {
+        return malloc(len);
+    }
+    return buf;
+}
+
+/* Take a free slot and reserve room for topic and data_len bytes of payload.
+ * topic may be NULL, data_len < 0 means the event carries no data. */
+static mqtt_event_t *mqtt_event_alloc(const char *event, const char *topic, int topic_len, int data_len)
+{
+    mqtt_event_t *e = NULL;
+    mqtt_event_t *old = NULL;
+
+    if (xQueueReceive(mqtt_event_free, (void *)&e, 0) != pdTRUE) {
+        /* Pool exhausted, apply the drop policy */
+        if (mqtt_event_conf.policy == ESP_LUA_DROP_OLDEST && xQueueReceive(mqtt_event_queue, (void *)&old, 0) == pdTRUE) {
+            mqtt_event_release(old);
+            mqtt_event_conf.dropped++;
+            xQueueReceive(mqtt_event_free, (void *)&e, 0);
+        } else if (mqtt_event_conf.policy == ESP_LUA_DROP_BLOCK) {
+            xQueueReceive(mqtt_event_free, (void *)&e, ESP_LUA_TIMEOUT_TICKS(mqtt_event_conf.block_ms));
+        }
+        if (e == NULL) {
+            mqtt_event_conf.dropped++;
+            return NULL;
+        }
+    }
+
+    e->event = event;
+    e->topic = NULL;
+    e->topic_len = 0;
+    e->data = NULL;
+    e->data_len = 0;
+
     if (topic) {
-        e.topic = calloc(sizeof(char), strlen(topic) + 1);
-        strcpy(e.topic, topic);
-    } else {
-        e.topic = NULL;
+        e->topic = mqtt_event_buf(e->topic_buf, sizeof(e->topic_buf), topic_len);
+        if (e->topic == NULL) {
+            mqtt_event_release(e);
+            mqtt_event_conf.dropped++;
+            return NULL;
+        }
+        memcpy(e->topic, topic, topic_len);
+        e->topic_len = topic_len;
     }
 
-    if (data) {
-        e.data = calloc(sizeof(char), strlen(data) + 1);
-        strcpy(e.data, data);
-    } else {
-        e.data = NULL;
-    } 
-    
+    if (data_len >= 0) {
+        e->data = mqtt_event_buf(e->data_buf, sizeof(e->data_buf), data_len);
+        if (e->data == NULL) {
+            mqtt_event_release(e);
+            mqtt_event_conf.dropped++;
+            return NULL;
+        }
+        e->data_len = data_len;
+    }
+    return e;
+}
+
+static int mqtt_event_commit(mqtt_event_t *e)
+{
     if (xQueueSend(mqtt_event_queue, (void *)&e, 0) != pdTRUE) {
-        free(e.event);
-        free(e.topic);
-        free(e.data);
+        mqtt_event_release(e);
+        mqtt_event_conf.dropped++;
         return -1;
     }
+    mqtt_event_conf.enqueued++;
+    UBaseType_t waiting = uxQueueMessagesWaiting(mqtt_event_queue);
+    if (waiting > mqtt_event_conf.high_water) {
+        mqtt_event_conf.high_water = waiting;
+    }
+    esp_lua_event_notify();
     return 0;
 }
 
+static int mqtt_event_send(const char *event, const char *topic, int topic_len, const char *data, int data_len)
+{
+    mqtt_event_t *e = mqtt_event_alloc(event, topic, topic_len, data ? data_len : -1);
+
+    if (e == NULL) {
+        return -1;
+    }
+    if (data) {
+        memcpy(e->data, data, data_len);
+    }
+    return mqtt_event_commit(e);
+}
+
+/* Messages larger than the client buffer arrive as several MQTT_EVENT_DATA
+ * fragments, only the first one carrying the topic. Stitch them back into
+ * one event so Lua always sees the whole payload. */
+static int mqtt_event_data(esp_mqtt_event_handle_t event)
+{
+    if (event->total_data_len <= event->data_len) {
+        return mqtt_event_send("MQTT_EVENT_DATA", event->topic, event->topic_len, event->data, event->data_len);
+    }
+
+    if (event->current_data_offset == 0) {
+        if (mqtt_event_partial) {
+            mqtt_event_release(mqtt_event_partial);
+        }
+        mqtt_event_partial = mqtt_event_alloc("MQTT_EVENT_DATA", event->topic, event->topic_len, event->total_data_len);
+    }
+
+    mqtt_event_t *e = mqtt_event_partial;
+    if (e == NULL || event->current_data_offset + event->data_len > e->data_len) {
+        return -1;
+    }
+    memcpy(e->data + event->current_data_offset, event->data, event->data_len);
+    if (event->current_data_offset + event->data_len < e->data_len) {
+        return 0;
+    }
+
+    mqtt_event_partial = NULL;
+    return mqtt_event_commit(e);
+}
+
 static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
 {
-    esp_mqtt_client_handle_t client = event->client;
     char msg_id_str[16] = "";
-    sprintf(msg_id_str, "%d", event->msg_id);
+    int msg_id_len = sprintf(msg_id_str, "%d", event->msg_id);
     switch (event->event_id) {
         case MQTT_EVENT_CONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-            mqtt_event_send("MQTT_EVENT_CONNECTED", NULL, NULL);
+            mqtt_event_send("MQTT_EVENT_CONNECTED", NULL, 0, NULL, 0);
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
-            mqtt_event_send("MQTT_EVENT_DISCONNECTED", NULL, NULL);
+            mqtt_event_send("MQTT_EVENT_DISCONNECTED", NULL, 0, NULL, 0);
             break;
         case MQTT_EVENT_SUBSCRIBED:
             ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-            
-            mqtt_event_send("MQTT_EVENT_SUBSCRIBED", NULL, msg_id_str);
+            mqtt_event_send("MQTT_EVENT_SUBSCRIBED", NULL, 0, msg_id_str, msg_id_len);
             break;
         case MQTT_EVENT_UNSUBSCRIBED:
             ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
-            mqtt_event_send("MQTT_EVENT_UNSUBSCRIBED", NULL, msg_id_str);
+            mqtt_event_send("MQTT_EVENT_UNSUBSCRIBED", NULL, 0, msg_id_str, msg_id_len);
             break;
         case MQTT_EVENT_PUBLISHED:
             ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
-            mqtt_event_send("MQTT_EVENT_PUBLISHED", NULL, msg_id_str);
+            mqtt_event_send("MQTT_EVENT_PUBLISHED", NULL, 0, msg_id_str, msg_id_len);
             break;
         case MQTT_EVENT_DATA:
             ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-            char *topic = calloc(sizeof(char), event->topic_len + 1);
-            char *data = calloc(sizeof(char), event->data_len + 1);
-            // sprintf(topic, "%.*s", event->topic_len, event->topic);
-            // sprintf(data, "%.*s", event->data_len, event->data);
-            memcpy(topic, event->topic, event->topic_len);
-            memcpy(data, event->data, event->data_len);
-            mqtt_event_send("MQTT_EVENT_DATA", topic, data);
-            free(topic);
-            free(data);
+            mqtt_event_data(event);
             break;
         case MQTT_EVENT_ERROR:
             ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
-            mqtt_event_send("MQTT_EVENT_ERROR", NULL, NULL);
+            mqtt_event_send("MQTT_EVENT_ERROR", NULL, 0, NULL, 0);
             break;
         default:
             ESP_LOGI(TAG, "Other event id:%d", event->event_id);
@@ -128,45 +275,166 @@ static int mqtt_app_start(char *url, void *context, char * cert_pem)
     return 0;
 }
 
-static int mqtt_app_stop()
+/* Topic filters registered with a Lua handler by mqtt.sub are kept in a trie
+ * with one node per topic level, so each message resolves its handler with
+ * one walk down the tree instead of a chain of string compares in Lua. The
+ * handler functions live in a registry table, nodes only keep their index. */
+#define MQTT_HANDLERS "esp_lib_mqtt.handlers"
+
+typedef struct mqtt_topic_node {
+    struct mqtt_topic_node *child;
+    struct mqtt_topic_node *next;
+    int ref;
+    char level[];
+} mqtt_topic_node_t;
+
+static mqtt_topic_node_t *mqtt_topic_root = NULL;
+
+static mqtt_topic_node_t *mqtt_topic_child(mqtt_topic_node_t *node, const char *level, int len)
 {
-    int ret = -1;
-    ret = esp_mqtt_client_destroy(client);
-    mqtt_event_t e;
-    while (1) {
-        if (xQueueReceive(mqtt_event_queue, (void *)&e, 0) == pdTRUE) {
-            free(e.event);
-            free(e.data);
-        } else{
+    for (mqtt_topic_node_t *c = node->child; c; c = c->next) {
+        if (strncmp(c->level, level, len) == 0 && c->level[len] == '\0') {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+static mqtt_topic_node_t *mqtt_topic_node_new(const char *level, int len)
+{
+    mqtt_topic_node_t *node = calloc(1, sizeof(mqtt_topic_node_t) + len + 1);
+    if (node) {
+        memcpy(node->level, level, len);
+        node->ref = LUA_NOREF;
+    }
+    return node;
+}
+
+/* Return the node for filter, creating missing levels when create is set */
+static mqtt_topic_node_t *mqtt_topic_find(const char *filter, bool create)
+{
+    if (mqtt_topic_root == NULL) {
+        if (!create || (mqtt_topic_root = mqtt_topic_node_new("", 0)) == NULL) {
+            return NULL;
+        }
+    }
+
+    mqtt_topic_node_t *node = mqtt_topic_root;
+    const char *level = filter;
+    while (node) {
+        const char *end = strchr(level, '/');
+        int len = end ? end - level : strlen(level);
+        mqtt_topic_node_t *c = mqtt_topic_child(node, level, len);
+        if (c == NULL && create && (c = mqtt_topic_node_new(level, len)) != NULL) {
+            c->next = node->child;
+            node->child = c;
+        }
+        node = c;
+        if (end == NULL) {
             break;
         }
+        level = end + 1;
     }
-    vQueueDelete(mqtt_event_queue);
+    return node;
+}
+
+/* Resolve the handler for a topic. Exact levels win over '+', which wins over '#' */
+static int mqtt_topic_match(mqtt_topic_node_t *node, const char *topic, int len, bool first)
+{
+    const char *end = memchr(topic, '/', len);
+    int level_len = end ? end - topic : len;
+    /* Wildcards never match topics starting with '$' */
+    bool wild = !(first && len > 0 && topic[0] == '$');
+    mqtt_topic_node_t *cand[2] = {mqtt_topic_child(node, topic, level_len), wild ? mqtt_topic_child(node, "+", 1) : NULL};
+    mqtt_topic_node_t *hash = wild ? mqtt_topic_child(node, "#", 1) : NULL;
+    int ref = LUA_NOREF;
+
+    for (int x = 0; x < 2 && ref == LUA_NOREF; x++) {
+        if (cand[x] == NULL) {
+            continue;
+        }
+        if (end) {
+            ref = mqtt_topic_match(cand[x], end + 1, len - level_len - 1, false);
+        } else {
+            ref = cand[x]->ref;
+            /* "a/#" also matches the parent level "a" */
+            mqtt_topic_node_t *parent = mqtt_topic_child(cand[x], "#", 1);
+            if (ref == LUA_NOREF && parent) {
+                ref = parent->ref;
+            }
+        }
+    }
+
+    if (ref == LUA_NOREF && hash) {
+        ref = hash->ref;
+    }
+    return ref;
+}
+
+static void mqtt_topic_free(mqtt_topic_node_t *node)
+{
+    while (node) {
+        mqtt_topic_node_t *next = node->next;
+        mqtt_topic_free(node->child);
+        free(node);
+        node = next;
+    }
+}
+
+static void mqtt_handlers_get(lua_State *L)
+{
+    if (lua_getfield(L, LUA_REGISTRYINDEX, MQTT_HANDLERS) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, MQTT_HANDLERS);
+    }
+}
+
+static int mqtt_app_stop()
+{
+    int ret = -1;
+    ret = esp_mqtt_client_destroy(client);
+    mqtt_event_pool_deinit();
+    mqtt_topic_free(mqtt_topic_root);
+    mqtt_topic_root = NULL;
     client = NULL;
 
     return ret;
 }
 
 /*
-[true, false] = mqtt.start(url[, cert])
-[true, false] = mqtt.sub('topic', 0)
+[true, false] = mqtt.start(url[, cert[, {queue = 32, policy = 'drop_newest' | 'drop_oldest' | 'block', block_ms = 10}]])
+[true, false] = mqtt.sub('topic', 0[, function(topic, data) end]) -- topic may use '+' and '#' wildcards
 [true, false] = mqtt.pub('topic', 'data', 0)
 [true, false] = mqtt.unsub('topic')
-[{event, data}, false] = mqtt.run([timeout_ms])
+[{event, topic, data}, false] = mqtt.run([timeout_ms]) -- blocks up to timeout_ms, < 0 waits forever,
+                                                         -- messages with a sub handler are dispatched, not returned
+[{{event, topic, data}, ...}, false] = mqtt.run_batch(max[, timeout_ms]) -- drains up to max queued events
+{depth, waiting, enqueued, dropped, high_water} = mqtt.stats()
 [true, false] = mqtt.stop()
 */
 static int mqtt_start(lua_State *L) 
 {
     int ret = -1;
+    esp_lua_queue_t conf;
 
+    esp_lua_queue_opts(L, 3, &conf, MQTT_EVENT_QUEUE_NUM);
     if (client != NULL) {
         ret = mqtt_app_stop();
     }
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, MQTT_HANDLERS);
     char *cert_pem = "";
     if (lua_tostring(L, 2) != NULL) {
         cert_pem = lua_tostring(L, 2);
     }
-    mqtt_event_queue = xQueueCreate(MQTT_EVENT_QUEUE_NUM, sizeof(mqtt_event_t));
+    mqtt_event_conf = conf;
+    if (mqtt_event_pool_init(mqtt_event_conf.depth) != 0) {
+        mqtt_event_pool_deinit();
+        lua_pushboolean(L, false);
+        return 1;
+    }
     ret = mqtt_app_start(luaL_checklstring(L, 1, NULL), (void*)L, cert_pem);
 
     lua_pushboolean(L, (ret >=0) ? true : false);
@@ -177,8 +445,22 @@ static int mqtt_sub(lua_State *L)
 {
     int ret = -1;
 
+    const char *topic = luaL_checklstring(L, 1, NULL);
     if (client != NULL) {
-        ret = esp_mqtt_client_subscribe(client, luaL_checklstring(L, 1, NULL), luaL_checkinteger(L, 2));
+        ret = esp_mqtt_client_subscribe(client, topic, luaL_checkinteger(L, 2));
+    }
+
+    if (ret >= 0 && lua_isfunction(L, 3)) {
+        mqtt_topic_node_t *node = mqtt_topic_find(topic, true);
+        if (node) {
+            mqtt_handlers_get(L);
+            luaL_unref(L, -1, node->ref);
+            lua_pushvalue(L, 3);
+            node->ref = luaL_ref(L, -2);
+            lua_pop(L, 1);
+        } else {
+            ret = -1;
+        }
     }
 
     lua_pushboolean(L, (ret >=0) ? true : false);
@@ -190,7 +472,9 @@ static int mqtt_pub(lua_State *L)
     int ret = -1;
 
     if (client != NULL) {
-        ret = esp_mqtt_client_publish(client, luaL_checklstring(L, 1, NULL), luaL_checklstring(L, 2, NULL), 0, luaL_checkinteger(L, 3), 0);
+        size_t len = 0;
+        const char *data = luaL_checklstring(L, 2, &len);
+        ret = esp_mqtt_client_publish(client, luaL_checklstring(L, 1, NULL), data, len, luaL_checkinteger(L, 3), 0);
     }
 
     lua_pushboolean(L, (ret >=0) ? true : false);
@@ -201,41 +485,114 @@ static int mqtt_unsub(lua_State *L)
 {
     int ret = -1;
 
+    const char *topic = luaL_checklstring(L, 1, NULL);
     if (client != NULL) {
-        ret = esp_mqtt_client_unsubscribe(client, luaL_checklstring(L, 1, NULL));  
+        ret = esp_mqtt_client_unsubscribe(client, topic);  
     } 
 
+    mqtt_topic_node_t *node = mqtt_topic_find(topic, false);
+    if (node && node->ref != LUA_NOREF) {
+        mqtt_handlers_get(L);
+        luaL_unref(L, -1, node->ref);
+        node->ref = LUA_NOREF;
+        lua_pop(L, 1);
+    }
+
     lua_pushboolean(L, (ret >=0) ? true : false);
     return 1;
 }
 
+static void mqtt_event_push(lua_State *L, mqtt_event_t *e)
+{
+    lua_createtable(L, 0, 3);
+    lua_pushstring(L, e->event);
+    lua_setfield(L, -2, "event");
+
+    if (e->topic) {
+        lua_pushlstring(L, e->topic, e->topic_len);
+        lua_setfield(L, -2, "topic");
+    }
+
+    if (e->data) {
+        lua_pushlstring(L, e->data, e->data_len);
+        lua_setfield(L, -2, "data");
+    }
+
+    mqtt_event_release(e);
+}
+
+/* Push the next event that has no sub handler, calling the handlers of the
+ * messages in front of it. Returns 0 once ticks pass without such an event. */
+static int mqtt_event_next(lua_State *L, TickType_t ticks)
+{
+    mqtt_event_t *e;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = ticks;
+
+    while (client != NULL && xQueueReceive(mqtt_event_queue, (void *)&e, wait) == pdTRUE) {
+        int ref = LUA_NOREF;
+        if (e->topic && mqtt_topic_root) {
+            ref = mqtt_topic_match(mqtt_topic_root, e->topic, e->topic_len, true);
+        }
+        if (ref == LUA_NOREF) {
+            mqtt_event_push(L, e);
+            return 1;
+        }
+
+        mqtt_handlers_get(L);
+        lua_rawgeti(L, -1, ref);
+        lua_remove(L, -2);
+        lua_pushlstring(L, e->topic, e->topic_len);
+        lua_pushlstring(L, e->data, e->data_len);
+        mqtt_event_release(e);
+        lua_call(L, 2, 0);
+
+        if (ticks != portMAX_DELAY) {
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            wait = (elapsed >= ticks) ? 0 : ticks - elapsed;
+        }
+    }
+    return 0;
+}
+
+static int mqtt_event_source(lua_State *L)
+{
+    return mqtt_event_next(L, 0);
+}
+
 static int mqtt_run(lua_State *L) 
 {
     int ret = -1;
 
-    mqtt_event_t e;
+    TickType_t ticks = ESP_LUA_TIMEOUT_TICKS(luaL_optinteger(L, 1, 0));
     if (client != NULL) {
-        if (xQueueReceive(mqtt_event_queue, (void *)&e, 0) == pdTRUE) {
-            lua_newtable(L);
-            lua_pushstring(L, "event");
-            lua_pushstring(L, e.event);
-            lua_settable(L,-3);
-            free(e.event);
-        
-            if (e.topic) {
-                lua_pushstring(L, "topic");
-                lua_pushstring(L, e.topic);
-                lua_settable(L,-3);
-                free(e.topic);
-            }
+        if (mqtt_event_next(L, ticks) == 1) {
+            return 1;
+        } else {
+            ret = -1;
+        }
+    }
 
-            if (e.data) {
-                lua_pushstring(L, "data");
-                lua_pushstring(L, e.data);
-                lua_settable(L,-3);
-                free(e.data);
-            }
+    lua_pushboolean(L, (ret >=0) ? true : false);
+    return 1;
+}
 
+static int mqtt_run_batch(lua_State *L) 
+{
+    int ret = -1;
+
+    int max = luaL_checkinteger(L, 1);
+    TickType_t ticks = ESP_LUA_TIMEOUT_TICKS(luaL_optinteger(L, 2, 0));
+    if (client != NULL && max > 0) {
+        if (mqtt_event_next(L, ticks) == 1) {
+            int num = MIN(max, (int)uxQueueMessagesWaiting(mqtt_event_queue) + 1);
+            int x = 1;
+            lua_createtable(L, num, 0);
+            lua_insert(L, -2);
+            lua_rawseti(L, -2, x);
+            while (x < max && mqtt_event_next(L, 0) == 1) {
+                lua_rawseti(L, -2, ++x);
+            }
             return 1;
         } else {
             ret = -1;
@@ -246,6 +603,12 @@ static int mqtt_run(lua_State *L)
     return 1;
 }
 
+static int mqtt_stats(lua_State *L) 
+{
+    esp_lua_queue_stats(L, &mqtt_event_conf, mqtt_event_queue ? uxQueueMessagesWaiting(mqtt_event_queue) : 0);
+    return 1;
+}
+
 static int mqtt_stop(lua_State *L) 
 {
     int ret = -1;
@@ -253,6 +616,8 @@ static int mqtt_stop(lua_State *L)
     if (client != NULL) {
         ret = mqtt_app_stop();
     }
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, MQTT_HANDLERS);
 
     lua_pushboolean(L, (ret >=0) ? true : false);
     return 1;
@@ -264,12 +629,15 @@ static const luaL_Reg mqttlib[] = {
     {"pub",   mqtt_pub},
     {"unsub",   mqtt_unsub},
     {"run",   mqtt_run},
+    {"run_batch",   mqtt_run_batch},
+    {"stats",   mqtt_stats},
     {"stop",   mqtt_stop},
     {NULL, NULL}
 };
 
 LUAMOD_API int esp_lib_mqtt(lua_State *L) 
 {
+    esp_lua_event_source_add(mqtt_event_source);
     luaL_newlib(L, mqttlib);
     lua_pushstring(L, "0.1.0");
     lua_setfield(L, -2, "_version");
@@ -2,6 +2,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
@@ -23,9 +24,35 @@ static int s_retry_num = 0;
 static wifi_ap_config_t wifi_ap_config = {0};
 static wifi_sta_config_t wifi_sta_config = {0};
 
+#define NET_EVENT_QUEUE_NUM 10
+
+static QueueHandle_t net_event_queue = NULL;
+
+typedef struct {
+    const char *event;
+    char data[20];
+} net_event_t;
+
+static int net_event_send(const char *event, const char *data)
+{
+    net_event_t e = {
+        .event = event,
+    };
+    if (net_event_queue == NULL) {
+        return -1;
+    }
+    strlcpy(e.data, data, sizeof(e.data));
+    if (xQueueSend(net_event_queue, (void *)&e, 0) != pdTRUE) {
+        return -1;
+    }
+    esp_lua_event_notify();
+    return 0;
+}
+
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
+    char str[20] = "";
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
@@ -39,20 +66,26 @@ static void event_handler(void* arg, esp_event_base_t event_base,
             xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
         }
         ESP_LOGI(TAG,"connect to the AP fail");
+        net_event_send("NET_EVENT_STA_DISCONNECTED", "");
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:%s",
                  ip4addr_ntoa(&event->ip_info.ip));
         s_retry_num = -1;
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        net_event_send("NET_EVENT_STA_GOT_IP", ip4addr_ntoa(&event->ip_info.ip));
     } else  if (event_id == WIFI_EVENT_AP_STACONNECTED) {
         wifi_event_ap_staconnected_t* event = (wifi_event_ap_staconnected_t*) event_data;
         ESP_LOGI(TAG, "station "MACSTR" join, AID=%d",
                  MAC2STR(event->mac), event->aid);
+        sprintf(str, ""MACSTR"", MAC2STR(event->mac));
+        net_event_send("NET_EVENT_AP_STACONNECTED", str);
     } else if (event_id == WIFI_EVENT_AP_STADISCONNECTED) {
         wifi_event_ap_stadisconnected_t* event = (wifi_event_ap_stadisconnected_t*) event_data;
         ESP_LOGI(TAG, "station "MACSTR" leave, AID=%d",
                  MAC2STR(event->mac), event->aid);
+        sprintf(str, ""MACSTR"", MAC2STR(event->mac));
+        net_event_send("NET_EVENT_AP_STADISCONNECTED", str);
     }
 }
 
@@ -248,16 +281,64 @@ static int net_info(lua_State *L)
     return 1;
 }
 
+static void net_event_push(lua_State *L, net_event_t *e)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "event");
+    lua_pushstring(L, e->event);
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "data");
+    lua_pushstring(L, e->data);
+    lua_settable(L,-3);
+}
+
+static int net_event_source(lua_State *L)
+{
+    net_event_t e;
+    if (net_event_queue == NULL) {
+        return 0;
+    }
+    if (xQueueReceive(net_event_queue, (void *)&e, 0) == pdTRUE) {
+        net_event_push(L, &e);
+        return 1;
+    }
+    return 0;
+}
+
+// [{event, data}, false] = net.run([timeout_ms])
+static int net_run(lua_State *L) 
+{
+    net_event_t e;
+    TickType_t ticks = ESP_LUA_TIMEOUT_TICKS(luaL_optinteger(L, 1, 0));
+    if (net_event_queue == NULL) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    if (xQueueReceive(net_event_queue, (void *)&e, ticks) == pdTRUE) {
+        net_event_push(L, &e);
+        return 1;
+    }
+
+    lua_pushboolean(L, false);
+    return 1;
+}
+
 static const luaL_Reg net_lib[] = {
     {"ap",   net_ap},
     {"sta",   net_sta},
     {"start",   net_start},
     {"info",   net_info},
+    {"run",   net_run},
     {NULL, NULL}
 };
 
 LUAMOD_API int esp_lib_net(lua_State *L) 
 {
+    if (net_event_queue == NULL) {
+        net_event_queue = xQueueCreate(NET_EVENT_QUEUE_NUM, sizeof(net_event_t));
+    }
+    esp_lua_event_source_add(net_event_source);
     luaL_newlib(L, net_lib);
     lua_pushstring(L, "0.1.0");
     lua_setfield(L, -2, "_version");
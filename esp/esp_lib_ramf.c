@@ -2,55 +2,659 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_vfs.h"
+#include "esp_heap_caps.h"
 #include "esp_lua_lib.h"
 
 static const char *TAG = "esp_lib_ramf";
 
-static int ramf_malloc(lua_State *L) 
+/* RAM files are served by a small esp_vfs filesystem mounted at
+ * ESP_LUA_RAM_FILE_BASE, so fopen/io.open/dofile, web.file and the httpd
+ * static handler reach them like any SPIFFS file. Files are named, reads
+ * never go past size and writes never past capacity. */
+#define RAMF_FILE_NUM 16
+#define RAMF_FD_NUM 8
+
+typedef struct {
+    bool used;
+    bool unlinked;
+    int open_count;
+    esp_lua_ramf_t ramf;
+} ramf_file_t;
+
+typedef struct {
+    ramf_file_t *file;
+    size_t pos;
+    int flags;
+} ramf_fd_t;
+
+static ramf_file_t ramf_files[RAMF_FILE_NUM] = {0};
+static ramf_fd_t ramf_fds[RAMF_FD_NUM] = {0};
+static SemaphoreHandle_t ramf_lock = NULL;
+
+/* Buffers come from a small arena: sizes are rounded up to classes in
+ * quarter power of two steps (256, 320, 384, 448, 512, ...) and freed blocks
+ * are kept on per class free lists, so files that come and go reuse the same
+ * blocks instead of fragmenting the heap. With PSRAM the buffers default to
+ * SPIRAM and leave internal RAM to WiFi/lwIP. Internal blocks, blocks above
+ * the largest class and everything when the cache is off are never kept, so
+ * they are allocated at their exact size straight from the heap. */
+#define RAMF_CLASS_MIN_SHIFT 8
+#define RAMF_CLASS_STEPS 4
+#define RAMF_CLASS_NUM (8 * RAMF_CLASS_STEPS + 1)
+#define RAMF_CLASS_MAX (64 * 1024)
+
+#define RAMF_CAPS_INTERNAL (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#define RAMF_CAPS_SPIRAM (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#define RAMF_CAPS_ANY (MALLOC_CAP_8BIT)
+
+/* Without PSRAM cached blocks would be internal RAM held back from WiFi/lwIP,
+ * so nothing is kept unless a build opts in with RAMF_ARENA_CACHE_MAX */
+#if CONFIG_SPIRAM
+#define RAMF_CAPS_DEFAULT RAMF_CAPS_SPIRAM
+#ifndef RAMF_ARENA_CACHE_MAX
+#define RAMF_ARENA_CACHE_MAX (256 * 1024)
+#endif
+#else
+#define RAMF_CAPS_DEFAULT RAMF_CAPS_ANY
+#ifndef RAMF_ARENA_CACHE_MAX
+#define RAMF_ARENA_CACHE_MAX (0)
+#endif
+#endif
+
+typedef enum {
+    RAMF_POOL_INTERNAL = 0,
+    RAMF_POOL_SPIRAM,
+    RAMF_POOL_ANY,
+    RAMF_POOL_NUM,
+} ramf_pool_t;
+
+typedef struct ramf_block {
+    struct ramf_block *next;
+} ramf_block_t;
+
+static const uint32_t ramf_pool_caps[RAMF_POOL_NUM] = {RAMF_CAPS_INTERNAL, RAMF_CAPS_SPIRAM, RAMF_CAPS_ANY};
+
+static struct {
+    ramf_block_t *free[RAMF_POOL_NUM][RAMF_CLASS_NUM];
+    size_t cached;
+    uint32_t allocs;
+    uint32_t reuses;
+} ramf_arena = {0};
+
+static int ramf_arena_pool(uint32_t caps)
+{
+    for (int x = 0; x < RAMF_POOL_NUM; x++) {
+        if (ramf_pool_caps[x] == caps) {
+            return x;
+        }
+    }
+    return RAMF_POOL_ANY;
+}
+
+static size_t ramf_arena_class_size(int class)
+{
+    int shift = RAMF_CLASS_MIN_SHIFT + class / RAMF_CLASS_STEPS;
+    return ((size_t)1 << shift) + (class % RAMF_CLASS_STEPS) * ((size_t)1 << (shift - 2));
+}
+
+/* Class index of a block of caps, -1 for blocks kept outside the arena */
+static int ramf_arena_class(size_t size, uint32_t caps)
+{
+    if (RAMF_ARENA_CACHE_MAX == 0 || caps == RAMF_CAPS_INTERNAL || size > RAMF_CLASS_MAX) {
+        return -1;
+    }
+    int class = 0;
+    while (ramf_arena_class_size(class) < size) {
+        class++;
+    }
+    return class;
+}
+
+static size_t ramf_arena_block_size(size_t size, uint32_t caps)
+{
+    int class = ramf_arena_class(size, caps);
+    return (class < 0) ? size : ramf_arena_class_size(class);
+}
+
+/* Hand every cached block back to the heap */
+static size_t ramf_arena_trim()
+{
+    size_t freed = ramf_arena.cached;
+    for (int pool = 0; pool < RAMF_POOL_NUM; pool++) {
+        for (int class = 0; class < RAMF_CLASS_NUM; class++) {
+            while (ramf_arena.free[pool][class] != NULL) {
+                ramf_block_t *b = ramf_arena.free[pool][class];
+                ramf_arena.free[pool][class] = b->next;
+                heap_caps_free(b);
+            }
+        }
+    }
+    ramf_arena.cached = 0;
+    return freed;
+}
+
+/* Allocate a block of at least size bytes, *block gets its real size */
+static void *ramf_arena_alloc(size_t size, uint32_t caps, size_t *block)
+{
+    int pool = ramf_arena_pool(caps);
+    int class = ramf_arena_class(size, caps);
+    *block = ramf_arena_block_size(size, caps);
+    if (class >= 0 && ramf_arena.free[pool][class] != NULL) {
+        ramf_block_t *b = ramf_arena.free[pool][class];
+        ramf_arena.free[pool][class] = b->next;
+        ramf_arena.cached -= *block;
+        ramf_arena.reuses++;
+        return b;
+    }
+    void *data = heap_caps_malloc(*block, caps);
+    if (data == NULL && ramf_arena.cached > 0) {
+        /* Blocks idling in the free lists may be just what the heap is missing */
+        ramf_arena_trim();
+        data = heap_caps_malloc(*block, caps);
+    }
+    if (data) {
+        ramf_arena.allocs++;
+    }
+    return data;
+}
+
+static void ramf_arena_free(void *data, size_t block, uint32_t caps)
+{
+    if (data == NULL) {
+        return;
+    }
+    int class = ramf_arena_class(block, caps);
+    if (class < 0 || block != ramf_arena_class_size(class) || ramf_arena.cached + block > RAMF_ARENA_CACHE_MAX) {
+        heap_caps_free(data);
+        return;
+    }
+    int pool = ramf_arena_pool(caps);
+    ramf_block_t *b = (ramf_block_t *)data;
+    b->next = ramf_arena.free[pool][class];
+    ramf_arena.free[pool][class] = b;
+    ramf_arena.cached += block;
+}
+
+/* Grow data to at least size bytes keeping its contents. Blocks outside the
+ * arena are resized in place where the heap allows it, so growing a big file
+ * does not need the old and the new buffer at once */
+static void *ramf_arena_realloc(void *data, size_t block, size_t size, uint32_t caps, size_t *new_block)
+{
+    if (data && ramf_arena_class(block, caps) < 0) {
+        *new_block = size;
+        void *tmp = heap_caps_realloc(data, size, caps);
+        if (tmp == NULL && ramf_arena.cached > 0) {
+            ramf_arena_trim();
+            tmp = heap_caps_realloc(data, size, caps);
+        }
+        return tmp;
+    }
+    void *tmp = ramf_arena_alloc(size, caps, new_block);
+    if (tmp && data) {
+        memcpy(tmp, data, MIN(block, *new_block));
+        ramf_arena_free(data, block, caps);
+    }
+    return tmp;
+}
+
+
+static ramf_file_t *ramf_file_find(const char *name)
+{
+    if (name[0] == '/') {
+        name++;
+    }
+    for (int x = 0; x < RAMF_FILE_NUM; x++) {
+        if (ramf_files[x].used && !ramf_files[x].unlinked && strcmp(ramf_files[x].ramf.name, name) == 0) {
+            return &ramf_files[x];
+        }
+    }
+    return NULL;
+}
+
+/* New empty file of at most capacity bytes, the buffer is reserved up front */
+static ramf_file_t *ramf_file_create(const char *name, size_t capacity, uint32_t caps)
+{
+    if (name[0] == '/') {
+        name++;
+    }
+    if (name[0] == '\0' || strchr(name, '/') || strlen(name) >= sizeof(((esp_lua_ramf_t *)0)->name)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    for (int x = 0; x < RAMF_FILE_NUM; x++) {
+        ramf_file_t *file = &ramf_files[x];
+        if (file->used) {
+            continue;
+        }
+        memset(file, 0, sizeof(ramf_file_t));
+        if (capacity) {
+            file->ramf.data = ramf_arena_alloc(capacity, caps, &file->ramf.reserved);
+            if (file->ramf.data == NULL) {
+                errno = ENOMEM;
+                return NULL;
+            }
+        }
+        file->ramf.capacity = capacity;
+        file->ramf.caps = caps;
+        strcpy(file->ramf.name, name);
+        file->used = true;
+        return file;
+    }
+    errno = ENFILE;
+    return NULL;
+}
+
+static void ramf_file_release(ramf_file_t *file)
+{
+    if (file->unlinked && file->open_count == 0) {
+        ramf_arena_free(file->ramf.data, file->ramf.reserved, file->ramf.caps);
+        memset(file, 0, sizeof(ramf_file_t));
+    }
+}
+
+static ramf_fd_t *ramf_fd_get(int fd)
+{
+    if (fd < 0 || fd >= RAMF_FD_NUM || ramf_fds[fd].file == NULL) {
+        errno = EBADF;
+        return NULL;
+    }
+    return &ramf_fds[fd];
+}
+
+static int ramf_vfs_open(void *ctx, const char *path, int flags, int mode)
+{
+    int fd = -1;
+    xSemaphoreTake(ramf_lock, portMAX_DELAY);
+    ramf_file_t *file = ramf_file_find(path);
+    if (file && (flags & O_CREAT) && (flags & O_EXCL)) {
+        errno = EEXIST;
+        goto exit;
+    }
+    if (file == NULL && !(flags & O_CREAT)) {
+        errno = ENOENT;
+        goto exit;
+    }
+    /* Take a descriptor first, a failed open must not leave a new file behind */
+    int slot = -1;
+    for (int x = 0; x < RAMF_FD_NUM; x++) {
+        if (ramf_fds[x].file == NULL) {
+            slot = x;
+            break;
+        }
+    }
+    if (slot < 0) {
+        errno = ENFILE;
+        goto exit;
+    }
+    if (file == NULL) {
+        /* Created by open() rather than ramf.malloc(), allowed to grow */
+        if ((file = ramf_file_create(path, 0, RAMF_CAPS_DEFAULT)) == NULL) {
+            goto exit;
+        }
+        file->ramf.capacity = ESP_LUA_MAX_FILE_SIZE;
+    }
+    fd = slot;
+    if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+        file->ramf.size = 0;
+    }
+    ramf_fds[fd].file = file;
+    ramf_fds[fd].pos = 0;
+    ramf_fds[fd].flags = flags;
+    file->open_count++;
+exit:
+    xSemaphoreGive(ramf_lock);
+    return fd;
+}
+
+static int ramf_vfs_close(void *ctx, int fd)
+{
+    int ret = -1;
+    xSemaphoreTake(ramf_lock, portMAX_DELAY);
+    ramf_fd_t *f = ramf_fd_get(fd);
+    if (f) {
+        f->file->open_count--;
+        ramf_file_release(f->file);
+        f->file = NULL;
+        ret = 0;
+    }
+    xSemaphoreGive(ramf_lock);
+    return ret;
+}
+
+static ssize_t ramf_vfs_read(void *ctx, int fd, void *dst, size_t size)
+{
+    ssize_t ret = -1;
+    xSemaphoreTake(ramf_lock, portMAX_DELAY);
+    ramf_fd_t *f = ramf_fd_get(fd);
+    if (f && (f->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+    } else if (f) {
+        esp_lua_ramf_t *ramf = &f->file->ramf;
+        ret = (f->pos < ramf->size) ? MIN(size, ramf->size - f->pos) : 0;
+        if (ret > 0) {
+            memcpy(dst, ramf->data + f->pos, ret);
+            f->pos += ret;
+        }
+    }
+    xSemaphoreGive(ramf_lock);
+    return ret;
+}
+
+static ssize_t ramf_vfs_write(void *ctx, int fd, const void *data, size_t size)
+{
+    ssize_t ret = -1;
+    xSemaphoreTake(ramf_lock, portMAX_DELAY);
+    ramf_fd_t *f = ramf_fd_get(fd);
+    if (f == NULL) {
+        goto exit;
+    }
+    if ((f->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        goto exit;
+    }
+    esp_lua_ramf_t *ramf = &f->file->ramf;
+    if (f->flags & O_APPEND) {
+        f->pos = ramf->size;
+    }
+    if (f->pos > ramf->capacity || size > ramf->capacity - f->pos) {
+        errno = ENOSPC;
+        goto exit;
+    }
+    size_t end = f->pos + size;
+    if (end > ramf->reserved) {
+        /* Grow geometrically, the capacity stays the upper bound */
+        size_t reserved = MIN(MAX(end, ramf->reserved * 2), ramf->capacity);
+        uint8_t *data = ramf_arena_realloc(ramf->data, ramf->reserved, reserved, ramf->caps, &reserved);
+        if (data == NULL) {
+            errno = ENOMEM;
+            goto exit;
+        }
+        ramf->data = data;
+        ramf->reserved = reserved;
+    }
+    if (f->pos > ramf->size) {
+        /* Writing after a seek past the end leaves a zero filled hole */
+        memset(ramf->data + ramf->size, 0, f->pos - ramf->size);
+    }
+    memcpy(ramf->data + f->pos, data, size);
+    f->pos = end;
+    ramf->size = MAX(ramf->size, end);
+    ret = size;
+exit:
+    xSemaphoreGive(ramf_lock);
+    return ret;
+}
+
+static off_t ramf_vfs_lseek(void *ctx, int fd, off_t offset, int mode)
+{
+    off_t ret = -1;
+    xSemaphoreTake(ramf_lock, portMAX_DELAY);
+    ramf_fd_t *f = ramf_fd_get(fd);
+    if (f) {
+        off_t base = (mode == SEEK_SET) ? 0 : (mode == SEEK_CUR) ? (off_t)f->pos : (off_t)f->file->ramf.size;
+        if (mode != SEEK_SET && mode != SEEK_CUR && mode != SEEK_END) {
+            errno = EINVAL;
+        } else if (base + offset < 0) {
+            errno = EINVAL;
+        } else {
+            f->pos = base + offset;
+            ret = f->pos;
+        }
+    }
+    xSemaphoreGive(ramf_lock);
+    return ret;
+}
+
+static void ramf_stat_fill(ramf_file_t *file, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = S_IFREG | 0666;
+    st->st_size = file->ramf.size;
+}
+
+static int ramf_vfs_fstat(void *ctx, int fd, struct stat *st)
+{
+    int ret = -1;
+    xSemaphoreTake(ramf_lock, portMAX_DELAY);
+    ramf_fd_t *f = ramf_fd_get(fd);
+    if (f) {
+        ramf_stat_fill(f->file, st);
+        ret = 0;
+    }
+    xSemaphoreGive(ramf_lock);
+    return ret;
+}
+
+static int ramf_vfs_stat(void *ctx, const char *path, struct stat *st)
+{
+    int ret = -1;
+    xSemaphoreTake(ramf_lock, portMAX_DELAY);
+    ramf_file_t *file = ramf_file_find(path);
+    if (file) {
+        ramf_stat_fill(file, st);
+        ret = 0;
+    } else {
+        errno = ENOENT;
+    }
+    xSemaphoreGive(ramf_lock);
+    return ret;
+}
+
+/* Open descriptors keep the data, it goes away with the last close */
+static int ramf_vfs_unlink(void *ctx, const char *path)
+{
+    int ret = -1;
+    xSemaphoreTake(ramf_lock, portMAX_DELAY);
+    ramf_file_t *file = ramf_file_find(path);
+    if (file) {
+        file->unlinked = true;
+        ramf_file_release(file);
+        ret = 0;
+    } else {
+        errno = ENOENT;
+    }
+    xSemaphoreGive(ramf_lock);
+    return ret;
+}
+
+static int ramf_vfs_rename(void *ctx, const char *src, const char *dst)
+{
+    int ret = -1;
+    xSemaphoreTake(ramf_lock, portMAX_DELAY);
+    ramf_file_t *file = ramf_file_find(src);
+    const char *name = (dst[0] == '/') ? dst + 1 : dst;
+    if (file == NULL) {
+        errno = ENOENT;
+    } else if (name[0] == '\0' || strchr(name, '/') || strlen(name) >= sizeof(file->ramf.name)) {
+        errno = EINVAL;
+    } else {
+        ramf_file_t *old = ramf_file_find(dst);
+        if (old && old != file) {
+            old->unlinked = true;
+            ramf_file_release(old);
+        }
+        strcpy(file->ramf.name, name);
+        ret = 0;
+    }
+    xSemaphoreGive(ramf_lock);
+    return ret;
+}
+
+static int ramf_vfs_init()
 {
-    char addr[32] = {0};
+    if (ramf_lock != NULL) {
+        return 0;
+    }
+    ramf_lock = xSemaphoreCreateMutex();
+    if (ramf_lock == NULL) {
+        return -1;
+    }
+    esp_vfs_t vfs = {
+        .flags = ESP_VFS_FLAG_CONTEXT_PTR,
+        .open_p = ramf_vfs_open,
+        .close_p = ramf_vfs_close,
+        .read_p = ramf_vfs_read,
+        .write_p = ramf_vfs_write,
+        .lseek_p = ramf_vfs_lseek,
+        .fstat_p = ramf_vfs_fstat,
+        .stat_p = ramf_vfs_stat,
+        .unlink_p = ramf_vfs_unlink,
+        .rename_p = ramf_vfs_rename,
+    };
+    esp_err_t err = esp_vfs_register(ESP_LUA_RAM_FILE_BASE, &vfs, NULL);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register ramf vfs: %s", esp_err_to_name(err));
+        vSemaphoreDelete(ramf_lock);
+        ramf_lock = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// [path, false] = ramf.malloc(size[, name[, 'default'|'spiram'|'internal']])
+static int ramf_malloc(lua_State *L)
+{
+    static const char *const caps_names[] = {"default", "spiram", "internal", NULL};
+    static const uint32_t caps_list[] = {RAMF_CAPS_DEFAULT, RAMF_CAPS_SPIRAM, RAMF_CAPS_INTERNAL};
+    static int id = 0;
+    char name[sizeof(((esp_lua_ramf_t *)0)->name)];
+    char path[sizeof(ESP_LUA_RAM_FILE_PATH) + sizeof(name)];
     int size = luaL_checkinteger(L, 1);
-    esp_lua_ramf_t *ramf = (esp_lua_ramf_t *)malloc(sizeof(esp_lua_ramf_t));
-    ramf->data = (uint8_t *)malloc(size);
-    ramf->size = 0;
-    sprintf(addr, ""ESP_LUA_RAM_FILE_PATH"%d", (int)ramf);
-    if (ramf != NULL) {
-        lua_pushstring(L, addr);
+    uint32_t caps = caps_list[luaL_checkoption(L, 3, "default", caps_names)];
+
+    if (lua_tostring(L, 2) != NULL) {
+        strlcpy(name, lua_tostring(L, 2), sizeof(name));
     } else {
+        snprintf(name, sizeof(name), "%d", ++id);
+    }
+
+    ramf_file_t *file = NULL;
+    if (size > 0 && ramf_lock != NULL) {
+        xSemaphoreTake(ramf_lock, portMAX_DELAY);
+        if (ramf_file_find(name) == NULL) {
+            file = ramf_file_create(name, size, caps);
+        }
+        xSemaphoreGive(ramf_lock);
+    }
+    if (file == NULL) {
         lua_pushboolean(L, false);
+        return 1;
     }
 
+    snprintf(path, sizeof(path), ESP_LUA_RAM_FILE_PATH"%s", name);
+    lua_pushstring(L, path);
     return 1;
 }
 
-static int ramf_free(lua_State *L) 
+// [true, false] = ramf.free(path)
+static int ramf_free(lua_State *L)
 {
-    char *addr = luaL_checklstring(L, 1, NULL);
-    if (strncmp(addr, ESP_LUA_RAM_FILE_PATH, strlen(ESP_LUA_RAM_FILE_PATH)) != 0) {
+    const char *path = luaL_checklstring(L, 1, NULL);
+    if (strncmp(path, ESP_LUA_RAM_FILE_PATH, strlen(ESP_LUA_RAM_FILE_PATH)) != 0) {
         lua_pushboolean(L, false);
         return 1;
     }
 
-    esp_lua_ramf_t *ramf = (esp_lua_ramf_t *)atoi(&addr[strlen(ESP_LUA_RAM_FILE_PATH)]);
-    free(ramf->data);
-    free(ramf);
-    lua_pushboolean(L, true);
+    lua_pushboolean(L, unlink(path) == 0);
+    return 1;
+}
 
+// [{files = 2, size = 1000, reserved = 1280, cached = 512, fragmentation = 35, ...}] = ramf.info()
+static int ramf_info(lua_State *L)
+{
+    int files = 0;
+    size_t size = 0, reserved = 0, cached = 0;
+    uint32_t allocs = 0, reuses = 0;
+    if (ramf_lock != NULL) {
+        xSemaphoreTake(ramf_lock, portMAX_DELAY);
+        for (int x = 0; x < RAMF_FILE_NUM; x++) {
+            if (ramf_files[x].used) {
+                files++;
+                size += ramf_files[x].ramf.size;
+                reserved += ramf_files[x].ramf.reserved;
+            }
+        }
+        cached = ramf_arena.cached;
+        allocs = ramf_arena.allocs;
+        reuses = ramf_arena.reuses;
+        xSemaphoreGive(ramf_lock);
+    }
+    /* Share of the memory held by ramf that does not hold file data */
+    size_t held = reserved + cached;
+    int fragmentation = held ? (int)((held - size) * 100 / held) : 0;
+
+    lua_newtable(L);
+    lua_pushstring(L, "files");
+    lua_pushinteger(L, files);
+    lua_settable(L, -3);
+    lua_pushstring(L, "size");
+    lua_pushinteger(L, size);
+    lua_settable(L, -3);
+    lua_pushstring(L, "reserved");
+    lua_pushinteger(L, reserved);
+    lua_settable(L, -3);
+    lua_pushstring(L, "cached");
+    lua_pushinteger(L, cached);
+    lua_settable(L, -3);
+    lua_pushstring(L, "fragmentation");
+    lua_pushinteger(L, fragmentation);
+    lua_settable(L, -3);
+    lua_pushstring(L, "allocs");
+    lua_pushinteger(L, allocs);
+    lua_settable(L, -3);
+    lua_pushstring(L, "reuses");
+    lua_pushinteger(L, reuses);
+    lua_settable(L, -3);
+    lua_pushstring(L, "internal_free");
+    lua_pushinteger(L, heap_caps_get_free_size(RAMF_CAPS_INTERNAL));
+    lua_settable(L, -3);
+    lua_pushstring(L, "internal_largest");
+    lua_pushinteger(L, heap_caps_get_largest_free_block(RAMF_CAPS_INTERNAL));
+    lua_settable(L, -3);
+    lua_pushstring(L, "spiram_free");
+    lua_pushinteger(L, heap_caps_get_free_size(RAMF_CAPS_SPIRAM));
+    lua_settable(L, -3);
+    lua_pushstring(L, "spiram_largest");
+    lua_pushinteger(L, heap_caps_get_largest_free_block(RAMF_CAPS_SPIRAM));
+    lua_settable(L, -3);
+    return 1;
+}
+
+// [bytes] = ramf.trim()
+static int ramf_trim(lua_State *L)
+{
+    size_t freed = 0;
+    if (ramf_lock != NULL) {
+        xSemaphoreTake(ramf_lock, portMAX_DELAY);
+        freed = ramf_arena_trim();
+        xSemaphoreGive(ramf_lock);
+    }
+    lua_pushinteger(L, freed);
     return 1;
 }
 
 static const luaL_Reg ramf_lib[] = {
     {"malloc", ramf_malloc},
     {"free", ramf_free},
+    {"info", ramf_info},
+    {"trim", ramf_trim},
     {NULL, NULL}
 };
 
-LUAMOD_API int esp_lib_ramf(lua_State *L) 
+LUAMOD_API int esp_lib_ramf(lua_State *L)
 {
+    ramf_vfs_init();
     luaL_newlib(L, ramf_lib);
     lua_pushstring(L, "0.1.0");
     lua_setfield(L, -2, "_version");
     return 1;
-}
\ No newline at end of file
+}
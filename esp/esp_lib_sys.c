@@ -4,6 +4,7 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include <time.h>
 #include <sys/time.h>
 #include "nvs_flash.h"
@@ -278,6 +279,123 @@ static int sys_yield(lua_State *L)
     return 1;
 }
 
+#define SYS_EVENT_SOURCE_NUM 8
+
+static esp_lua_event_source_t sys_event_source[SYS_EVENT_SOURCE_NUM] = {NULL};
+static int sys_event_source_num = 0;
+static SemaphoreHandle_t sys_event_signal = NULL;
+
+int esp_lua_event_source_add(esp_lua_event_source_t source)
+{
+    if (sys_event_signal == NULL) {
+        sys_event_signal = xSemaphoreCreateBinary();
+    }
+
+    for (int x = 0; x < sys_event_source_num; x++) {
+        if (sys_event_source[x] == source) {
+            return 0;
+        }
+    }
+
+    if (sys_event_source_num >= SYS_EVENT_SOURCE_NUM) {
+        ESP_LOGE(TAG, "Too many event sources");
+        return -1;
+    }
+    sys_event_source[sys_event_source_num++] = source;
+    return 0;
+}
+
+void esp_lua_event_notify(void)
+{
+    if (sys_event_signal) {
+        xSemaphoreGive(sys_event_signal);
+    }
+}
+
+void esp_lua_queue_opts(lua_State *L, int idx, esp_lua_queue_t *q, int depth)
+{
+    static const char *const policies[] = {"drop_newest", "drop_oldest", "block", NULL};
+
+    memset(q, 0, sizeof(esp_lua_queue_t));
+    q->depth = depth;
+    q->policy = ESP_LUA_DROP_NEWEST;
+    q->block_ms = 10;
+
+    if (lua_istable(L, idx)) {
+        lua_getfield(L, idx, "queue");
+        q->depth = luaL_optinteger(L, -1, depth);
+        lua_getfield(L, idx, "policy");
+        q->policy = luaL_checkoption(L, -1, "drop_newest", policies);
+        lua_getfield(L, idx, "block_ms");
+        q->block_ms = luaL_optinteger(L, -1, q->block_ms);
+        lua_pop(L, 3);
+    }
+
+    if (q->depth < 1) {
+        q->depth = 1;
+    }
+}
+
+void esp_lua_queue_stats(lua_State *L, esp_lua_queue_t *q, int waiting)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "depth");
+    lua_pushinteger(L, q->depth);
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "waiting");
+    lua_pushinteger(L, waiting);
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "enqueued");
+    lua_pushinteger(L, q->enqueued);
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "dropped");
+    lua_pushinteger(L, q->dropped);
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "high_water");
+    lua_pushinteger(L, q->high_water);
+    lua_settable(L,-3);
+}
+
+// [event, false] = sys.wait([timeout_ms])
+static int sys_wait(lua_State *L) 
+{
+    static int next = 0;
+    TickType_t ticks = ESP_LUA_TIMEOUT_TICKS(luaL_optinteger(L, 1, -1));
+    TickType_t start = xTaskGetTickCount();
+
+    while (1) {
+        /* Poll sources round-robin so a busy one cannot starve the others */
+        for (int x = 0; x < sys_event_source_num; x++) {
+            int n = (next + x) % sys_event_source_num;
+            if (sys_event_source[n](L) == 1) {
+                next = (n + 1) % sys_event_source_num;
+                return 1;
+            }
+        }
+
+        TickType_t wait = portMAX_DELAY;
+        if (ticks != portMAX_DELAY) {
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            if (elapsed >= ticks) {
+                break;
+            }
+            wait = ticks - elapsed;
+        }
+        /* The signal is binary, a notify between the poll above and this
+         * take is remembered, so no event can be missed */
+        if (sys_event_signal == NULL || xSemaphoreTake(sys_event_signal, wait) != pdTRUE) {
+            break;
+        }
+    }
+
+    lua_pushboolean(L, false);
+    return 1;
+}
+
 static void time_sync_notification_cb(struct timeval *tv)
 {
     ESP_LOGI(TAG, "Notification of a time synchronization event");
@@ -633,6 +751,7 @@ static const luaL_Reg syslib[] = {
     {"init", sys_init},
     {"delay", sys_delay},
     {"yield", sys_yield},
+    {"wait", sys_wait},
     {"sntp", sys_sntp},
     {"restart", sys_restart},
     {"md5sum", sys_md5sum},
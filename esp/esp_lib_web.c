@@ -1,6 +1,9 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <sys/unistd.h>
+#include <sys/stat.h>
+#include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
@@ -12,10 +15,17 @@
 #include "esp_tls.h"
 
 #include "esp_http_client.h"
+#include "esp_timer.h"
+#include "esp32/rom/md5_hash.h"
+#include "mbedtls/sha256.h"
 #include "esp_lua_lib.h"
 
 static const char *TAG = "esp_lib_web";
 
+#define WEB_STREAM_BUFSIZE (1024)
+#define WEB_FILE_BUFSIZE (4096)
+#define WEB_FILE_PATH_MAX (128)
+
 static char *http_rest_get_with_url(char *url, char * cert_pem)
 {
     esp_http_client_config_t config = {
@@ -51,13 +61,166 @@ static char *http_rest_get_with_url(char *url, char * cert_pem)
     return buf;
 }
 
-static int http_rest_file_with_url(char *url, char *file, char * cert_pem)
+/* Optional checksums verified on the fly while a file downloads */
+typedef struct {
+    const char *md5;
+    const char *sha256;
+    struct MD5Context md5_ctx;
+    mbedtls_sha256_context sha256_ctx;
+} web_file_hash_t;
+
+static void web_file_hash_init(web_file_hash_t *hash)
+{
+    MD5Init(&hash->md5_ctx);
+    mbedtls_sha256_init(&hash->sha256_ctx);
+    mbedtls_sha256_starts_ret(&hash->sha256_ctx, 0);
+}
+
+static void web_file_hash_update(web_file_hash_t *hash, const char *buf, int len)
+{
+    if (hash->md5) {
+        MD5Update(&hash->md5_ctx, (const unsigned char *)buf, len);
+    }
+    if (hash->sha256) {
+        mbedtls_sha256_update_ret(&hash->sha256_ctx, (const unsigned char *)buf, len);
+    }
+}
+
+static void web_hex(char *hex, const unsigned char *digest, int len)
+{
+    for (int i = 0; i < len; i++) {
+        sprintf(&hex[i * 2], "%02x", (unsigned int)digest[i]);
+    }
+}
+
+static int web_file_hash_check(web_file_hash_t *hash)
+{
+    unsigned char digest[32];
+    char hex[65];
+    int ret = 0;
+
+    if (hash->md5) {
+        MD5Final(digest, &hash->md5_ctx);
+        web_hex(hex, digest, 16);
+        if (strcasecmp(hex, hash->md5) != 0) {
+            ret = -1;
+        }
+    }
+    if (hash->sha256) {
+        mbedtls_sha256_finish_ret(&hash->sha256_ctx, digest);
+        web_hex(hex, digest, 32);
+        if (strcasecmp(hex, hash->sha256) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static void web_file_hash_free(web_file_hash_t *hash)
+{
+    mbedtls_sha256_free(&hash->sha256_ctx);
+}
+
+/* A resumable download keeps a small sidecar next to the partial file with
+ * the source url and the full size, so a retry can ask the server for the
+ * missing tail with a Range request instead of starting over. */
+#define WEB_FILE_CKPT_SUFFIX ".ck"
+
+static long web_file_ckpt_read(const char *ckpt, const char *url)
+{
+    long total = -1;
+    FILE* f = fopen(ckpt, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    size_t url_len = strlen(url);
+    char *line = malloc(url_len + 2);
+    if (line && fread(line, 1, url_len + 1, f) == url_len + 1
+        && memcmp(line, url, url_len) == 0 && line[url_len] == '\n') {
+        if (fscanf(f, "%ld", &total) != 1) {
+            total = -1;
+        }
+    }
+    free(line);
+    fclose(f);
+    return total;
+}
+
+static int web_file_ckpt_write(const char *ckpt, const char *url, long total)
+{
+    FILE* f = fopen(ckpt, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    fprintf(f, "%s\n%ld\n", url, total);
+    fclose(f);
+    return 0;
+}
+
+/* Feed the part of the file already on storage into the running checksums */
+static int web_file_hash_seed(web_file_hash_t *hash, const char *file, char *buf)
+{
+    if (hash->md5 == NULL && hash->sha256 == NULL) {
+        return 0;
+    }
+    FILE* f = fopen(file, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    size_t read_len;
+    while ((read_len = fread(buf, sizeof(char), WEB_FILE_BUFSIZE, f)) > 0) {
+        web_file_hash_update(hash, buf, read_len);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int http_rest_file_with_url(char *url, char *file, char * cert_pem, web_file_hash_t *hash, bool resume, int *rate)
 {
+    char ckpt[WEB_FILE_PATH_MAX];
+    long offset = 0;
+    long total = -1;
+    struct stat file_stat;
+
+    snprintf(ckpt, sizeof(ckpt), "%s"WEB_FILE_CKPT_SUFFIX, file);
+    if (resume && (total = web_file_ckpt_read(ckpt, url)) != -1 && stat(file, &file_stat) == 0) {
+        offset = file_stat.st_size;
+    }
+    if (total > 0 && offset == total) {
+        /* Completed before the checkpoint was removed, nothing left to fetch */
+        char *buf = malloc(WEB_FILE_BUFSIZE);
+        if (buf == NULL || web_file_hash_seed(hash, file, buf) != 0) {
+            ESP_LOGE(TAG, "Failed to prepare download");
+            free(buf);
+            return -1;
+        }
+        free(buf);
+        unlink(ckpt);
+        if (web_file_hash_check(hash) != 0) {
+            ESP_LOGE(TAG, "Checksum mismatch : %s", file);
+            unlink(file);
+            return -1;
+        }
+        if (rate) {
+            *rate = 0;
+        }
+        return offset;
+    }
+
     esp_http_client_config_t config = {
         .url = url,
         .cert_pem = cert_pem,
     };
     esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL) {
+        ESP_LOGE(TAG, "Failed to init HTTP client");
+        return -1;
+    }
+    if (offset > 0) {
+        char range[32];
+        snprintf(range, sizeof(range), "bytes=%ld-", offset);
+        esp_http_client_set_header(client, "Range", range);
+    }
     esp_err_t err;
     if ((err = esp_http_client_open(client, 0)) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
@@ -65,80 +228,94 @@ static int http_rest_file_with_url(char *url, char *file, char * cert_pem)
         return -1;
     }
     int content_length =  esp_http_client_fetch_headers(client);
-    if (content_length <= 0 || content_length > ESP_LUA_MAX_FILE_SIZE) {
-        content_length = ESP_LUA_MAX_FILE_SIZE;
+    if (esp_http_client_is_chunked_response(client) || content_length <= 0) {
+        /* Chunked responses report 0, the length is simply unknown */
+        content_length = -1;
     }
 
-    if (strncmp(file, ESP_LUA_RAM_FILE_PATH, strlen(ESP_LUA_RAM_FILE_PATH)) == 0) {
-        esp_lua_ramf_t *ramf = (esp_lua_ramf_t *)atoi(&file[strlen(ESP_LUA_RAM_FILE_PATH)]);
-        char *buf = (char *)ramf->data;
-        int read_len = esp_http_client_read(client, buf, content_length);
-        if (read_len <= 0) {
-            ESP_LOGE(TAG, "Error read data");
-            esp_http_client_cleanup(client);
-            return -1;
-        }
-        buf[read_len] = 0;
-        ramf->size = read_len;
+    int status_code = esp_http_client_get_status_code(client);
+    const char *mode = "w";
+    if (status_code == 206 && offset > 0 && (total < 0 || content_length < 0 || offset + content_length == total)) {
+        ESP_LOGI(TAG, "Resuming %s at %ld", file, offset);
+        mode = "a";
+    } else if (status_code == 200) {
+        /* No checkpoint, or the server ignored the range: start over */
+        offset = 0;
+    } else if (status_code == 206) {
+        /* The remote file changed size, the partial copy is useless */
+        ESP_LOGE(TAG, "Checkpoint mismatch : %s", file);
+        unlink(ckpt);
+        unlink(file);
+        esp_http_client_cleanup(client);
+        return -1;
+    } else {
+        ESP_LOGE(TAG, "HTTP Status = %d", status_code);
+        esp_http_client_cleanup(client);
+        return -1;
+    }
 
-        ESP_LOGI(TAG, "HTTP Stream reader Status = %d, content_length = %d",
-                        esp_http_client_get_status_code(client),
-                        esp_http_client_get_content_length(client));
+    char *buf = malloc(WEB_FILE_BUFSIZE);
+    if (buf == NULL || (offset > 0 && web_file_hash_seed(hash, file, buf) != 0)) {
+        ESP_LOGE(TAG, "Failed to prepare download");
         esp_http_client_cleanup(client);
+        free(buf);
+        return -1;
+    }
 
-        return read_len;
+    if (resume) {
+        web_file_ckpt_write(ckpt, url, (content_length >= 0) ? offset + content_length : -1);
     }
 
-    FILE* f = fopen(file, "w");
+    FILE* f = fopen(file, mode);
     if (f == NULL) {
         ESP_LOGE(TAG, "Failed to open file for writing");
         esp_http_client_cleanup(client);
+        free(buf);
         return -1;
     }
-    char *buf = calloc(sizeof(char), BUFSIZ);
-    int read_len = 0;
-    int write_len = 0;
-    int x = 0;
-    for (x = 0; x < content_length / BUFSIZ; x++) {
-        read_len = esp_http_client_read(client, buf, BUFSIZ);
-        if (read_len <= 0) {
-            esp_http_client_cleanup(client);
-            fclose(f);
-            free(buf);
-            return BUFSIZ * x;
-        }
-        write_len = fwrite(buf, sizeof(char), read_len, f);
-        if (write_len != BUFSIZ) {
-            esp_http_client_cleanup(client);
-            fclose(f);
-            free(buf);
-            return BUFSIZ * x + write_len;
-        }
-    }
-    if (content_length % BUFSIZ) {
-        read_len = esp_http_client_read(client, buf, content_length % BUFSIZ);
-        if (read_len <= 0) {
-            esp_http_client_cleanup(client);
-            fclose(f);
-            free(buf);
-            return BUFSIZ * x;
-        }
-        write_len = fwrite(buf, sizeof(char), read_len, f);
-        if (write_len != (content_length % BUFSIZ)) {
-            esp_http_client_cleanup(client);
-            fclose(f);
-            free(buf);
-            return BUFSIZ * x + write_len;
+
+    /* Read until the server signals the end of the body, this covers
+     * both Content-Length and chunked responses */
+    int total_len = 0;
+    int read_len = -1;
+    int64_t start = esp_timer_get_time();
+    while ((read_len = esp_http_client_read(client, buf, WEB_FILE_BUFSIZE)) > 0) {
+        if (fwrite(buf, sizeof(char), read_len, f) != read_len) {
+            ESP_LOGE(TAG, "Failed to write file");
+            read_len = -1;
+            break;
         }
+        web_file_hash_update(hash, buf, read_len);
+        total_len += read_len;
     }
-
-    ESP_LOGI(TAG, "HTTP Stream reader Status = %d, content_length = %d",
-                    esp_http_client_get_status_code(client),
-                    esp_http_client_get_content_length(client));
-    esp_http_client_cleanup(client);
+    int64_t elapsed = esp_timer_get_time() - start;
     fclose(f);
     free(buf);
-    return content_length;
+
+    bool complete = esp_http_client_is_complete_data_received(client);
+    ESP_LOGI(TAG, "HTTP Stream reader Status = %d, content_length = %d, read = %d",
+                    status_code,
+                    esp_http_client_get_content_length(client),
+                    total_len);
+    esp_http_client_cleanup(client);
+
+    if (read_len < 0 || !complete) {
+        /* Keep the partial file and checkpoint for the next attempt */
+        ESP_LOGE(TAG, "Error read data");
+        return -1;
+    }
+    unlink(ckpt);
+
+    if (web_file_hash_check(hash) != 0) {
+        ESP_LOGE(TAG, "Checksum mismatch : %s", file);
+        unlink(file);
+        return -1;
+    }
+
+    if (rate) {
+        *rate = (elapsed > 0) ? (int)((int64_t)total_len * 1000000 / elapsed) : 0;
+    }
+    return offset + total_len;
 }
 
 static char *http_rest_post_with_url(char *url, char *post, char * cert_pem)
@@ -213,9 +390,13 @@ static int web_rest(lua_State *L)
     return 1;
 }
 
+// [len, bytes_per_sec | false] = web.file(file, url[, cert[, {md5 = hex, sha256 = hex, resume = true}]])
 static int web_file(lua_State *L) 
 {
     int ret = -1;
+    int rate = 0;
+    bool resume = false;
+    web_file_hash_t hash = {0};
 
     char *file = luaL_checklstring(L, 1, NULL);
     char *url = luaL_checklstring(L, 2, NULL);
@@ -225,10 +406,24 @@ static int web_file(lua_State *L)
         cert_pem = lua_tostring(L, 3);
     }
 
-    ret = http_rest_file_with_url(url, file, cert_pem);
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "md5");
+        hash.md5 = lua_tostring(L, -1);
+        lua_getfield(L, 4, "sha256");
+        hash.sha256 = lua_tostring(L, -1);
+        lua_getfield(L, 4, "resume");
+        resume = lua_toboolean(L, -1);
+        /* Leave the strings on the stack so they stay alive */
+    }
+    web_file_hash_init(&hash);
+
+    ret = http_rest_file_with_url(url, file, cert_pem, &hash, resume, &rate);
+    web_file_hash_free(&hash);
 
     if (ret >= 0) {
         lua_pushinteger(L, ret);
+        lua_pushinteger(L, rate);
+        return 2;
     } else {
         lua_pushboolean(L, false);
     }
@@ -236,6 +431,523 @@ static int web_file(lua_State *L)
     return 1;
 }
 
+// [len, status | false] = web.stream(url, function(chunk) end[, cert]) -- return false from fn to stop early
+static int web_stream(lua_State *L) 
+{
+    char *url = luaL_checklstring(L, 1, NULL);
+    char *cert_pem = "";
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    if (lua_tostring(L, 3) != NULL) {
+        cert_pem = lua_tostring(L, 3);
+    }
+
+    esp_http_client_config_t config = {
+        .url = url,
+        .cert_pem = cert_pem,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    esp_err_t err;
+    if ((err = esp_http_client_open(client, 0)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        esp_http_client_cleanup(client);
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    esp_http_client_fetch_headers(client);
+
+    /* The body is handed to Lua one buffer at a time, so memory stays
+     * bounded by WEB_STREAM_BUFSIZE whatever the response size */
+    char *buf = malloc(WEB_STREAM_BUFSIZE);
+    int total_len = 0;
+    int read_len = -1;
+    int status = LUA_OK;
+    while (buf && (read_len = esp_http_client_read(client, buf, WEB_STREAM_BUFSIZE)) > 0) {
+        lua_pushvalue(L, 2);
+        lua_pushlstring(L, buf, read_len);
+        if ((status = lua_pcall(L, 1, 1, 0)) != LUA_OK) {
+            break;
+        }
+        total_len += read_len;
+        bool stop = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        if (stop) {
+            break;
+        }
+    }
+
+    int status_code = esp_http_client_get_status_code(client);
+    ESP_LOGI(TAG, "HTTP Stream reader Status = %d, content_length = %d",
+                    status_code,
+                    esp_http_client_get_content_length(client));
+    esp_http_client_cleanup(client);
+    free(buf);
+
+    if (status != LUA_OK) {
+        /* Rethrow the callback error once the connection is released */
+        return lua_error(L);
+    }
+
+    if (read_len < 0) {
+        ESP_LOGE(TAG, "Error read data");
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    lua_pushinteger(L, total_len);
+    lua_pushinteger(L, status_code);
+    return 2;
+}
+
+/* A session keeps one esp_http_client alive across requests so calls to
+ * the same backend reuse the TCP/TLS connection (HTTP/1.1 keep-alive)
+ * instead of paying a handshake every time. */
+#define WEB_SESSION "esp_lib_web.session"
+
+typedef struct {
+    esp_http_client_handle_t client;
+    char *base_url;
+    char *cert_pem;
+} web_session_t;
+
+static void web_session_close(web_session_t *s)
+{
+    if (s->client) {
+        esp_http_client_cleanup(s->client);
+        s->client = NULL;
+    }
+    free(s->base_url);
+    free(s->cert_pem);
+    s->base_url = NULL;
+    s->cert_pem = NULL;
+}
+
+static int web_session_request(lua_State *L, esp_http_client_method_t method)
+{
+    web_session_t *s = (web_session_t *)luaL_checkudata(L, 1, WEB_SESSION);
+    const char *path = luaL_optlstring(L, 2, "", NULL);
+    const char *post = NULL;
+    size_t post_len = 0;
+    if (method == HTTP_METHOD_POST) {
+        post = luaL_checklstring(L, 3, &post_len);
+    }
+    luaL_argcheck(L, s->client != NULL, 1, "session closed");
+
+    const char *url = lua_pushfstring(L, "%s%s", s->base_url, path);
+    esp_http_client_set_url(s->client, url);
+    esp_http_client_set_method(s->client, method);
+    if (method == HTTP_METHOD_POST) {
+        esp_http_client_set_header(s->client, "Content-Type", "application/x-www-form-urlencoded");
+    } else {
+        esp_http_client_delete_header(s->client, "Content-Type");
+    }
+
+    /* The server may have dropped the idle connection, in that case
+     * reconnect once before giving up */
+    int content_length = -1;
+    for (int retry = 0; retry < 2 && content_length < 0; retry++) {
+        esp_err_t err = esp_http_client_open(s->client, post_len);
+        if (err == ESP_OK) {
+            int write_len = 0;
+            while (write_len < post_len) {
+                int len = esp_http_client_write(s->client, post + write_len, post_len - write_len);
+                if (len <= 0) {
+                    break;
+                }
+                write_len += len;
+            }
+            if (write_len == post_len) {
+                content_length = esp_http_client_fetch_headers(s->client);
+            }
+        } else {
+            ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        }
+        if (content_length < 0) {
+            esp_http_client_close(s->client);
+        }
+    }
+    if (content_length < 0) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    char *buf = malloc(WEB_STREAM_BUFSIZE);
+    int read_len = -1;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    while (buf && (read_len = esp_http_client_read(s->client, buf, WEB_STREAM_BUFSIZE)) > 0) {
+        luaL_addlstring(&b, buf, read_len);
+    }
+    free(buf);
+
+    int status_code = esp_http_client_get_status_code(s->client);
+    if (read_len < 0 || !esp_http_client_is_complete_data_received(s->client)) {
+        /* Leftover body bytes would corrupt the next response */
+        esp_http_client_close(s->client);
+    }
+    if (read_len < 0) {
+        ESP_LOGE(TAG, "Error read data");
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    luaL_pushresult(&b);
+    lua_pushinteger(L, status_code);
+    return 2;
+}
+
+// [body, status | false] = session:get([path])
+static int web_session_get(lua_State *L) 
+{
+    return web_session_request(L, HTTP_METHOD_GET);
+}
+
+// [body, status | false] = session:post(path, post)
+static int web_session_post(lua_State *L) 
+{
+    return web_session_request(L, HTTP_METHOD_POST);
+}
+
+// session:close()
+static int web_session_gc(lua_State *L) 
+{
+    web_session_close((web_session_t *)luaL_checkudata(L, 1, WEB_SESSION));
+    return 0;
+}
+
+static const luaL_Reg web_session_lib[] = {
+    {"get",   web_session_get},
+    {"post",   web_session_post},
+    {"close",   web_session_gc},
+    {"__gc",   web_session_gc},
+    {NULL, NULL}
+};
+
+// [session, false] = web.session(base_url[, cert])
+static int web_session(lua_State *L) 
+{
+    const char *base_url = luaL_checklstring(L, 1, NULL);
+    const char *cert_pem = "";
+
+    if (lua_tostring(L, 2) != NULL) {
+        cert_pem = lua_tostring(L, 2);
+    }
+
+    web_session_t *s = (web_session_t *)lua_newuserdata(L, sizeof(web_session_t));
+    memset(s, 0, sizeof(web_session_t));
+    if (luaL_newmetatable(L, WEB_SESSION)) {
+        luaL_setfuncs(L, web_session_lib, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+
+    /* The client keeps pointers into its config, so own the strings */
+    s->base_url = strdup(base_url);
+    s->cert_pem = strdup(cert_pem);
+    if (s->base_url && s->cert_pem) {
+        esp_http_client_config_t config = {
+            .url = s->base_url,
+            .cert_pem = s->cert_pem,
+        };
+        s->client = esp_http_client_init(&config);
+    }
+
+    if (s->client == NULL) {
+        web_session_close(s);
+        lua_pushboolean(L, false);
+    }
+    return 1;
+}
+
+/* Asynchronous requests are handed to a small pool of worker tasks through
+ * a job queue. Each worker runs the whole connect/TLS/read cycle and posts
+ * the result to web_event_queue, which Lua drains with web.run() or
+ * sys.wait(), so the Lua task keeps serving other events meanwhile. */
+#define WEB_WORKER_NUM 2
+#define WEB_WORKER_STACK_SIZE (8192)
+#define WEB_JOB_QUEUE_NUM 8
+#define WEB_EVENT_QUEUE_NUM 16
+
+static QueueHandle_t web_job_queue = NULL;
+static QueueHandle_t web_event_queue = NULL;
+
+typedef struct {
+    int id;
+    esp_http_client_method_t method;
+    char *url;
+    char *post;
+    size_t post_len;
+    char *cert_pem;
+} web_job_t;
+
+typedef struct {
+    const char *event;
+    int id;
+    int status;
+    char *data;
+    int data_len;
+    int read;
+    int total;
+    int rate;
+} web_event_t;
+
+static int web_event_send(web_event_t *e, TickType_t ticks)
+{
+    if (xQueueSend(web_event_queue, (void *)e, ticks) != pdTRUE) {
+        free(e->data);
+        return -1;
+    }
+    esp_lua_event_notify();
+    return 0;
+}
+
+/* Run one request, returning the whole body in a buffer grown on demand */
+static char *http_rest_with_url(web_job_t *job, int *status, int *len)
+{
+    esp_http_client_config_t config = {
+        .url = job->url,
+        .cert_pem = job->cert_pem,
+        .method = job->method,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL) {
+        ESP_LOGE(TAG, "Failed to init HTTP client");
+        return NULL;
+    }
+    if (job->method == HTTP_METHOD_POST) {
+        esp_http_client_set_header(client, "Content-Type", "application/x-www-form-urlencoded");
+    }
+    esp_err_t err;
+    if ((err = esp_http_client_open(client, job->post_len)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        esp_http_client_cleanup(client);
+        return NULL;
+    }
+    int write_len = 0;
+    while (write_len < job->post_len) {
+        int len = esp_http_client_write(client, job->post + write_len, job->post_len - write_len);
+        if (len <= 0) {
+            ESP_LOGE(TAG, "Failed to write post data");
+            esp_http_client_cleanup(client);
+            return NULL;
+        }
+        write_len += len;
+    }
+    int content_length =  esp_http_client_fetch_headers(client);
+    int size = (content_length > 0) ? MIN(content_length, ESP_LUA_MAX_STR_SIZE) : WEB_STREAM_BUFSIZE;
+    char *buf = malloc(size);
+    int read_len = 0;
+    int total_len = 0;
+    while (buf) {
+        if (total_len == size) {
+            if (esp_http_client_is_complete_data_received(client)) {
+                /* The body exactly filled the buffer, no need to grow for EOF */
+                break;
+            }
+            if (size >= ESP_LUA_MAX_STR_SIZE) {
+                ESP_LOGE(TAG, "Content too long");
+                read_len = -1;
+                break;
+            }
+            size = MIN(size * 2, ESP_LUA_MAX_STR_SIZE);
+            char *tmp = realloc(buf, size);
+            if (tmp == NULL) {
+                read_len = -1;
+                break;
+            }
+            buf = tmp;
+        }
+        if ((read_len = esp_http_client_read(client, buf + total_len, size - total_len)) <= 0) {
+            break;
+        }
+        total_len += read_len;
+    }
+    *status = esp_http_client_get_status_code(client);
+    esp_http_client_cleanup(client);
+
+    if (buf == NULL || read_len < 0) {
+        ESP_LOGE(TAG, "Error read data");
+        free(buf);
+        return NULL;
+    }
+    *len = total_len;
+    return buf;
+}
+
+static void web_worker_task(void *arg)
+{
+    web_job_t job;
+    while (1) {
+        if (xQueueReceive(web_job_queue, (void *)&job, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        web_event_t e = {
+            .event = "WEB_EVENT_RESPONSE",
+            .id = job.id,
+        };
+        e.data = http_rest_with_url(&job, &e.status, &e.data_len);
+        if (e.data == NULL) {
+            e.event = "WEB_EVENT_ERROR";
+        }
+        free(job.url);
+        free(job.post);
+        free(job.cert_pem);
+        /* Block rather than lose a result, Lua consuming slowly only holds up the workers */
+        web_event_send(&e, portMAX_DELAY);
+    }
+}
+
+static int web_worker_init()
+{
+    if (web_job_queue != NULL) {
+        return 0;
+    }
+    if (web_event_queue == NULL) {
+        /* Results would have nowhere to go */
+        return -1;
+    }
+    web_job_queue = xQueueCreate(WEB_JOB_QUEUE_NUM, sizeof(web_job_t));
+    if (web_job_queue == NULL) {
+        return -1;
+    }
+    int started = 0;
+    for (int x = 0; x < WEB_WORKER_NUM; x++) {
+        if (xTaskCreate(web_worker_task, "web_worker", WEB_WORKER_STACK_SIZE, NULL, 5, NULL) == pdPASS) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        ESP_LOGE(TAG, "Failed to start web workers");
+        vQueueDelete(web_job_queue);
+        web_job_queue = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// GET:  [id, false] = web.request_async('GET', url[, cert])
+// POST: [id, false] = web.request_async('POST', url, post[, cert])
+static int web_request_async(lua_State *L) 
+{
+    static int id = 0;
+    web_job_t job = {0};
+    const char *cert_pem = "";
+    const char *post = NULL;
+    int cert_idx = 3;
+
+    const char *method = luaL_checklstring(L, 1, NULL);
+    const char *url = luaL_checklstring(L, 2, NULL);
+    if (strcmp(method, "GET") == 0) {
+        job.method = HTTP_METHOD_GET;
+    } else if (strcmp(method, "POST") == 0) {
+        job.method = HTTP_METHOD_POST;
+        post = luaL_checklstring(L, 3, &job.post_len);
+        cert_idx = 4;
+    } else {
+        return luaL_argerror(L, 1, "GET or POST expected");
+    }
+    if (lua_tostring(L, cert_idx) != NULL) {
+        cert_pem = lua_tostring(L, cert_idx);
+    }
+
+    if (web_worker_init() != 0) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    job.id = ++id;
+    job.url = strdup(url);
+    job.cert_pem = strdup(cert_pem);
+    if (post) {
+        job.post = malloc(job.post_len);
+        if (job.post) {
+            memcpy(job.post, post, job.post_len);
+        }
+    }
+    if (job.url == NULL || job.cert_pem == NULL || (post && job.post == NULL)
+        || xQueueSend(web_job_queue, (void *)&job, 0) != pdTRUE) {
+        free(job.url);
+        free(job.post);
+        free(job.cert_pem);
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    lua_pushinteger(L, job.id);
+    return 1;
+}
+
+static void web_event_push(lua_State *L, web_event_t *e)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "event");
+    lua_pushstring(L, e->event);
+    lua_settable(L,-3);
+
+    lua_pushstring(L, "id");
+    lua_pushinteger(L, e->id);
+    lua_settable(L,-3);
+
+    if (e->status) {
+        lua_pushstring(L, "status");
+        lua_pushinteger(L, e->status);
+        lua_settable(L,-3);
+    }
+
+    if (e->data) {
+        lua_pushstring(L, "data");
+        lua_pushlstring(L, e->data, e->data_len);
+        lua_settable(L,-3);
+        free(e->data);
+    }
+
+    if (strncmp(e->event, "WEB_EVENT_OTA", strlen("WEB_EVENT_OTA")) == 0) {
+        lua_pushstring(L, "read");
+        lua_pushinteger(L, e->read);
+        lua_settable(L,-3);
+
+        lua_pushstring(L, "total");
+        lua_pushinteger(L, e->total);
+        lua_settable(L,-3);
+
+        lua_pushstring(L, "rate");
+        lua_pushinteger(L, e->rate);
+        lua_settable(L,-3);
+    }
+}
+
+static int web_event_source(lua_State *L)
+{
+    web_event_t e;
+    if (web_event_queue == NULL) {
+        return 0;
+    }
+    if (xQueueReceive(web_event_queue, (void *)&e, 0) == pdTRUE) {
+        web_event_push(L, &e);
+        return 1;
+    }
+    return 0;
+}
+
+// [{event, id, status, data, read, total, rate}, false] = web.run([timeout_ms])
+static int web_run(lua_State *L) 
+{
+    web_event_t e;
+    TickType_t ticks = ESP_LUA_TIMEOUT_TICKS(luaL_optinteger(L, 1, 0));
+    if (web_event_queue == NULL) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    if (xQueueReceive(web_event_queue, (void *)&e, ticks) == pdTRUE) {
+        web_event_push(L, &e);
+        return 1;
+    }
+
+    lua_pushboolean(L, false);
+    return 1;
+}
+
 #include "esp_ota_ops.h"
 #include "esp_https_ota.h"
 
@@ -274,15 +986,217 @@ static int web_ota(lua_State *L)
     return 1;
 }
 
+/* Background OTA: a dedicated task streams the image into the next update
+ * partition with esp_ota_write(), so the Lua task only sees events. After a
+ * dropped connection it reconnects with a Range header starting at the last
+ * written offset instead of downloading the image again. */
+#define WEB_OTA_STACK_SIZE (8192)
+#define WEB_OTA_BUFSIZE (4096)
+#define WEB_OTA_RETRY_NUM 5
+#define WEB_OTA_RETRY_DELAY_MS (2000)
+#define WEB_OTA_PROGRESS_MS (1000)
+#define WEB_OTA_EVENT_TIMEOUT_MS (5000)
+
+typedef struct {
+    char *url;
+    char *cert_pem;
+} web_ota_t;
+
+static volatile bool web_ota_running = false;
+static volatile bool web_ota_abort_flag = false;
+
+static void web_ota_event(const char *event, int read, int total, int64_t start)
+{
+    int64_t elapsed = esp_timer_get_time() - start;
+    web_event_t e = {
+        .event = event,
+        .read = read,
+        .total = total,
+        .rate = (elapsed > 0) ? (int)((int64_t)read * 1000000 / elapsed) : 0,
+    };
+    /* Progress is advisory, drop it when Lua lags instead of stalling the download.
+     * The final event waits a bounded time so the task always exits. */
+    web_event_send(&e, (strcmp(event, "WEB_EVENT_OTA_PROGRESS") == 0) ? 0 : WEB_OTA_EVENT_TIMEOUT_MS / portTICK_PERIOD_MS);
+}
+
+/* One connection worth of download starting at offset, returns bytes written or -1 on a fatal error */
+static int web_ota_fetch(web_ota_t *ota, esp_ota_handle_t handle, char *buf, int offset, int *total, int64_t start)
+{
+    esp_http_client_config_t config = {
+        .url = ota->url,
+        .cert_pem = ota->cert_pem,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL) {
+        return 0;
+    }
+    if (offset > 0) {
+        char range[32];
+        snprintf(range, sizeof(range), "bytes=%d-", offset);
+        esp_http_client_set_header(client, "Range", range);
+    }
+    esp_err_t err;
+    if ((err = esp_http_client_open(client, 0)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        esp_http_client_cleanup(client);
+        return 0;
+    }
+    int content_length = esp_http_client_fetch_headers(client);
+    int status = esp_http_client_get_status_code(client);
+    if (offset == 0 && status == 200) {
+        *total = content_length;
+    } else if (offset == 0 || status != 206) {
+        /* A server ignoring Range would replay the image from byte 0 into the middle of the partition */
+        ESP_LOGE(TAG, "Unexpected HTTP status %d at offset %d", status, offset);
+        esp_http_client_cleanup(client);
+        return -1;
+    }
+
+    int written = 0;
+    int64_t last = esp_timer_get_time();
+    while (!web_ota_abort_flag) {
+        int read_len = esp_http_client_read(client, buf, WEB_OTA_BUFSIZE);
+        if (read_len <= 0) {
+            break;
+        }
+        if ((err = esp_ota_write(handle, buf, read_len)) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+            written = -1;
+            break;
+        }
+        written += read_len;
+        if (esp_timer_get_time() - last >= WEB_OTA_PROGRESS_MS * 1000) {
+            last = esp_timer_get_time();
+            web_ota_event("WEB_EVENT_OTA_PROGRESS", offset + written, *total, start);
+        }
+    }
+    esp_http_client_cleanup(client);
+    return written;
+}
+
+static void web_ota_task(void *arg)
+{
+    web_ota_t *ota = (web_ota_t *)arg;
+    const esp_partition_t *update = esp_ota_get_next_update_partition(NULL);
+    esp_ota_handle_t handle = 0;
+    char *buf = malloc(WEB_OTA_BUFSIZE);
+    int64_t start = esp_timer_get_time();
+    int offset = 0;
+    int total = -1;
+    int retry = 0;
+    bool done = false;
+
+    if (update == NULL || buf == NULL || esp_ota_begin(update, OTA_SIZE_UNKNOWN, &handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to begin OTA");
+        handle = 0;
+    } else {
+        while (!web_ota_abort_flag && retry < WEB_OTA_RETRY_NUM) {
+            int written = web_ota_fetch(ota, handle, buf, offset, &total, start);
+            if (written < 0) {
+                break;
+            }
+            offset += written;
+            if (total > 0 && offset >= total) {
+                done = true;
+                break;
+            }
+            if (total <= 0 && written > 0) {
+                /* Without a length EOF is the only end marker, esp_ota_end() catches a truncated image */
+                done = !web_ota_abort_flag;
+                break;
+            }
+            if (web_ota_abort_flag) {
+                break;
+            }
+            retry = (written > 0) ? 0 : retry + 1;
+            ESP_LOGW(TAG, "OTA interrupted at %d/%d, resuming", offset, total);
+            vTaskDelay(WEB_OTA_RETRY_DELAY_MS / portTICK_PERIOD_MS);
+        }
+    }
+
+    if (handle) {
+        /* esp_ota_end() validates the image, call it on failure too so the handle is released */
+        if (esp_ota_end(handle) != ESP_OK) {
+            done = false;
+        }
+    }
+    if (done && esp_ota_set_boot_partition(update) != ESP_OK) {
+        done = false;
+    }
+    free(buf);
+    free(ota->url);
+    free(ota->cert_pem);
+    free(ota);
+    web_ota_running = false;
+    web_ota_event(done ? "WEB_EVENT_OTA_DONE" : "WEB_EVENT_OTA_FAILED", offset, total, start);
+    vTaskDelete(NULL);
+}
+
+// [true, false] = web.ota_start(url[, cert])
+static int web_ota_start(lua_State *L) 
+{
+    const char *url = luaL_checklstring(L, 1, NULL);
+    const char *cert_pem = "";
+
+    if (lua_tostring(L, 2) != NULL) {
+        cert_pem = lua_tostring(L, 2);
+    }
+
+    if (web_ota_running || web_event_queue == NULL) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    web_ota_t *ota = (web_ota_t *)calloc(1, sizeof(web_ota_t));
+    if (ota) {
+        ota->url = strdup(url);
+        ota->cert_pem = strdup(cert_pem);
+    }
+    web_ota_abort_flag = false;
+    web_ota_running = true;
+    if (ota == NULL || ota->url == NULL || ota->cert_pem == NULL
+        || xTaskCreate(web_ota_task, "web_ota", WEB_OTA_STACK_SIZE, ota, 5, NULL) != pdPASS) {
+        web_ota_running = false;
+        if (ota) {
+            free(ota->url);
+            free(ota->cert_pem);
+            free(ota);
+        }
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// [true, false] = web.ota_abort()
+static int web_ota_abort(lua_State *L) 
+{
+    web_ota_abort_flag = web_ota_running;
+    lua_pushboolean(L, web_ota_running);
+    return 1;
+}
+
 static const luaL_Reg weblib[] = {
     {"rest",   web_rest},
     {"file",   web_file},
+    {"stream",   web_stream},
+    {"session",   web_session},
+    {"request_async",   web_request_async},
+    {"run",   web_run},
     {"ota",    web_ota},
+    {"ota_start",    web_ota_start},
+    {"ota_abort",    web_ota_abort},
     {NULL, NULL}
 };
 
 LUAMOD_API int esp_lib_web(lua_State *L) 
 {
+    if (web_event_queue == NULL) {
+        web_event_queue = xQueueCreate(WEB_EVENT_QUEUE_NUM, sizeof(web_event_t));
+    }
+    esp_lua_event_source_add(web_event_source);
     luaL_newlib(L, weblib);
     lua_pushstring(L, "0.1.0");
     lua_setfield(L, -2, "_version");
@@ -13,13 +13,56 @@ extern "C" {
 #endif
 #define ESP_LUA_MAX_FILE_SIZE   (200*1024) // 200 KB
 
-#define ESP_LUA_RAM_FILE_PATH "/lua/ramf/"
+#define ESP_LUA_RAM_FILE_BASE "/lua/ramf"
+#define ESP_LUA_RAM_FILE_PATH ESP_LUA_RAM_FILE_BASE "/"
 
+/* Convert a Lua timeout in ms to ticks, rounding up so short waits still block.
+ * A negative timeout waits forever. */
+#define ESP_LUA_TIMEOUT_TICKS(ms) ((ms) < 0 ? portMAX_DELAY : (TickType_t)(((ms) + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS))
+
+/* A RAM file: size bytes are valid, reserved are allocated and writes may
+ * grow it up to capacity. caps are the heap_caps the buffer comes from */
 typedef struct {
+    char name[32];
     uint8_t *data;
     size_t size;
+    size_t reserved;
+    size_t capacity;
+    uint32_t caps;
 } esp_lua_ramf_t;
 
+/* Event sources polled by sys.wait(). A source pushes its next pending
+ * event onto the Lua stack and returns 1, or returns 0 when it has none.
+ * Producers call esp_lua_event_notify() after queueing an event. */
+typedef int (*esp_lua_event_source_t)(lua_State *L);
+
+int esp_lua_event_source_add(esp_lua_event_source_t source);
+
+void esp_lua_event_notify(void);
+
+/* What an event producer does when its queue is full */
+typedef enum {
+    ESP_LUA_DROP_NEWEST = 0,
+    ESP_LUA_DROP_OLDEST,
+    ESP_LUA_DROP_BLOCK,
+} esp_lua_drop_policy_t;
+
+typedef struct {
+    int depth;
+    esp_lua_drop_policy_t policy;
+    int block_ms;
+    uint32_t enqueued;
+    uint32_t dropped;
+    uint32_t high_water;
+} esp_lua_queue_t;
+
+/* Fill q from an optional {queue = n, policy = 'drop_newest' | 'drop_oldest' | 'block', block_ms = n}
+ * table at idx and reset its counters */
+void esp_lua_queue_opts(lua_State *L, int idx, esp_lua_queue_t *q, int depth);
+
+/* Push {depth, waiting, enqueued, dropped, high_water} */
+void esp_lua_queue_stats(lua_State *L, esp_lua_queue_t *q, int waiting);
+
 LUAMOD_API int esp_lib_sys(lua_State *L);
 
 LUAMOD_API int esp_lib_net(lua_State *L);
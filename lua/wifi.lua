@@ -8,7 +8,7 @@ function wifi.start_ap(ssid, passwd)
     httpd.start(ssid)
 
     while (1) do
-        local handle = httpd.run()
+        local handle = httpd.run(1000)
         if (handle) then
             print(string.format("event: %s, uri: %s, data: %s", handle.event, handle.uri, handle.data))
             if (handle.uri == '/config') then
@@ -26,10 +26,6 @@ function wifi.start_ap(ssid, passwd)
                 end
             end
         end
-
-        if (not handle) then
-            sys.yield()
-        end
     end
     return true
 end
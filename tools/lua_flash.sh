@@ -66,7 +66,12 @@ fi
 if [ "$input" == 1 ]; then
     echo "copy main.lua"
     cp main/*.lua lua
-    ./$ESP_LUA_LIB_PATH/tools/mkspiffs -c lua -b 4096 -p 256 -s $BIN_SIZE lua.bin
+    echo "gzip web assets"
+    ./$ESP_LUA_LIB_PATH/tools/lua_gzip.sh lua lua_spiffs
+    if [ "$?" != 0 ] ;then
+        exit 1
+    fi
+    ./$ESP_LUA_LIB_PATH/tools/mkspiffs -c lua_spiffs -b 4096 -p 256 -s $BIN_SIZE lua.bin
     if [ "$?" != 0 ] ;then
         exit 1
     fi
@@ -85,7 +90,12 @@ elif [ "$input" == 2 ]; then
 else
     echo "copy main.lua"
     cp main/*.lua lua
-    ./$ESP_LUA_LIB_PATH/tools/mkspiffs -c lua -b 4096 -p 256 -s $BIN_SIZE lua.bin
+    echo "gzip web assets"
+    ./$ESP_LUA_LIB_PATH/tools/lua_gzip.sh lua lua_spiffs
+    if [ "$?" != 0 ] ;then
+        exit 1
+    fi
+    ./$ESP_LUA_LIB_PATH/tools/mkspiffs -c lua_spiffs -b 4096 -p 256 -s $BIN_SIZE lua.bin
     if [ "$?" != 0 ] ;then
         exit 1
     fi
@@ -0,0 +1,39 @@
+SRC=$1
+OUT=$2
+KEEP=$3
+if [ ! -n "$SRC" ] ;then
+    SRC="lua"
+fi
+if [ ! -n "$OUT" ] ;then
+    OUT="lua_spiffs"
+fi
+if [ ! -d "$SRC" ]; then
+    echo "Directory $SRC does not exists."
+    exit 1
+fi
+if [ "$(cd $SRC && pwd)" == "$(mkdir -p $OUT && cd $OUT && pwd)" ]; then
+    echo "Output directory must differ from $SRC."
+    exit 1
+fi
+
+# The source tree is never touched: it is copied to OUT and the web assets
+# are gzipped there, OUT is what goes into the SPIFFS image. httpd serves
+# name.gz with Content-Encoding: gzip and keeps serving it when name itself
+# is gone, so only the .gz copies are kept; pass KEEP=1 to keep both.
+# Keep names short, ".gz" counts against the SPIFFS object name length.
+rm -rf $OUT
+cp -r $SRC $OUT
+if [ "$?" != 0 ] ;then
+    exit 1
+fi
+for file in $(find $OUT -type f \( -name "*.html" -o -name "*.js" -o -name "*.css" -o -name "*.svg" \)); do
+    if [ "$KEEP" == 1 ]; then
+        gzip -9 -n -f -k $file
+    else
+        gzip -9 -n -f $file
+    fi
+    if [ "$?" != 0 ] ;then
+        exit 1
+    fi
+    echo "gzip $file"
+done